@@ -90,9 +90,11 @@ struct elis_State {
   elis_Object *quote;
   elis_Object *gc_stack[ELIS_STACK_SIZE];
   size_t mark_stack_size;
+  size_t mark_stack_idx;
   elis_Object **mark_stack;
   elis_Allocator allocator;
   elis_Error error;
+  elis_GCHook gc_hook;
   void *userdata;
 };
 
@@ -125,6 +127,8 @@ static void collect_garbage(elis_State *S) {
   int i;
   elis_Object *page;
 
+  if (S->gc_hook) S->gc_hook(S, 0);
+
   for (i = 0; i < S->gc_stack_idx; ++i) elis_mark(S, S->gc_stack[i]);
   elis_mark(S, S->symbols);
 
@@ -149,6 +153,8 @@ static void collect_garbage(elis_State *S) {
       free_object(S, obj);
     }
   }
+
+  if (S->gc_hook) S->gc_hook(S, 1);
 }
 
 static elis_Object *make_object(elis_State *S) {
@@ -178,9 +184,9 @@ static void resize_mark_stack(elis_State *S, size_t new_size) {
   S->mark_stack = (elis_Object **) ALLOCATE(S->mark_stack, new_size);
 }
 
-static void push_mark_stack(elis_State *S, elis_Object *obj, size_t *i) {
-  if (S->mark_stack_size == *i) resize_mark_stack(S, S->mark_stack_size << 1);
-  S->mark_stack[(*i)++] = obj;
+static void push_mark_stack(elis_State *S, elis_Object *obj) {
+  if (S->mark_stack_size == S->mark_stack_idx) resize_mark_stack(S, S->mark_stack_size << 1);
+  S->mark_stack[S->mark_stack_idx++] = obj;
 }
 
 elis_State *elis_init(elis_Allocator alloc, void *udata) {
@@ -270,6 +276,12 @@ void elis_error(elis_State *S, const char *msg) {
   exit(EXIT_FAILURE);
 }
 
+elis_GCHook elis_on_gc(elis_State *S, elis_GCHook func) {
+  elis_GCHook hook = S->gc_hook;
+  S->gc_hook = func;
+  return hook;
+}
+
 void elis_push_gc(elis_State *S, elis_Object *obj) {
   if (S->gc_stack_idx == ELIS_STACK_SIZE) elis_error(S, "stack overflow");
   S->gc_stack[S->gc_stack_idx++] = obj;
@@ -284,7 +296,8 @@ int elis_save_gc(elis_State *S) {
 }
 
 void elis_mark(elis_State *S, elis_Object *obj) {
-  size_t mark_stack_idx = 0;
+  /* userdata mark handlers may call elis_mark, so nested calls keep outer stack */
+  size_t mark_stack_base = S->mark_stack_idx;
 
 restart:
   if (!MARKED(obj)) {
@@ -293,7 +306,7 @@ restart:
 
     switch (TYPE(obj)) {
       case ELIS_PAIR:
-        push_mark_stack(S, tmp, &mark_stack_idx);
+        push_mark_stack(S, tmp);
         /* fall through */
 
       case ELIS_SYMBOL:
@@ -308,8 +321,8 @@ restart:
     }
   }
 
-  if (mark_stack_idx != 0) {
-    obj = S->mark_stack[--mark_stack_idx];
+  if (S->mark_stack_idx != mark_stack_base) {
+    obj = S->mark_stack[--S->mark_stack_idx];
     goto restart;
   }
 }
@@ -61,6 +61,9 @@ void elis_write_fp(elis_State *S, elis_Object *obj, FILE *fp);
  * Garbage collector
  */
 
+typedef void (*elis_GCHook)(elis_State *S, int done);
+
+elis_GCHook elis_on_gc(elis_State *S, elis_GCHook func);
 void elis_push_gc(elis_State *S, elis_Object *obj);
 void elis_restore_gc(elis_State *S, int idx);
 int elis_save_gc(elis_State *S);
@@ -25,18 +25,110 @@
 #include <tgmath.h>
 #include <stdbool.h>
 #include <SDL2/SDL.h>
+#ifdef __unix__
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 #include "elis/elis.h"
 
 /*
  * Globals
  */
 
-typedef struct { int width, height, tiles[]; } Tilemap;
-typedef struct { uint32_t length; int volume; uint8_t *buffer; } Sound;
+typedef struct { uint16_t x, len; } Span;
+typedef struct { uint32_t first; uint16_t count; uint8_t kind; } Row;
+typedef struct { SDL_Surface *surface; int key, size; bool dirty; Row *rows; Span *spans; } Image;
+typedef struct { int width, height, bits; void *tiles, *mapped; size_t mapped_size; int cell, max_solid; bool edge; uint8_t *solid; } Tilemap;
+typedef struct { int x0, y0, x1, y1; } Rect;
+typedef struct Command Command;
+struct Command { void (*func)(const Command *cmd, Rect r); Rect bounds; Image *image; int x, y, s, c; };
+
+/* music is streamed from disk through ring of converted samples, refilled by background thread */
+#define STREAM_SIZE  (1 << 16)
+#define STREAM_CHUNK 4096
+
+typedef struct Stream Stream;
+struct Stream {
+  SDL_RWops *file; SDL_AudioStream *cvt; uint32_t offset, size, remain; bool flushed, fresh;
+  SDL_atomic_t read, write, restart, loop, eof; Stream *next; uint8_t ring[STREAM_SIZE];
+};
+
+/* voices of sound are listed in order of start, lists are owned by mixer */
+typedef struct { int first, last; } VoiceList;
+typedef struct { uint32_t length; int volume; uint8_t *buffer; Stream *stream; VoiceList voices; int count, limit, priority; } Sound;
+
+/* spatial hash, entity is listed in every cell it overlaps */
+#define GRID_BUCKETS 1024
+
+typedef struct { elis_Object *obj; double x0, y0, x1, y1; int cx0, cy0, cx1, cy1, stamp, next; } Entity;
+typedef struct { int entity, cx, cy; } Entry;
+typedef struct { Entry *entries; int count, cap; } Bucket;
+typedef struct { double cell; Entity *entities; int num_entities, max_entities, free_entity, stamp; Bucket buckets[GRID_BUCKETS]; } Grid;
+
+/* particles are stored by fields, so they are updated by plain loops over arrays */
+typedef struct {
+  int count, max;
+  float gx, gy, drag, bounce;
+  Tilemap *map;
+  elis_Object *map_obj;
+  float *x, *y, *vx, *vy;
+  int *life, *c;
+} Emitter;
 
 static elis_State *S;
-static int wheel;
-static uint64_t time_step;
+
+/* input of current frame and input seen by last `step`, mouse buttons follow keys */
+#define NUM_BUTTONS (SDL_NUM_SCANCODES + 3)
+
+typedef struct { uint8_t buttons[NUM_BUTTONS]; int x, y, wheel; } Input;
+
+static Input input, last_input;
+
+/* frame pacing, `step` is called with fixed time step */
+#define SPIN_TIME 2 /* ms to wait without sleeping */
+
+static uint64_t time_step, lag, game_steps;
+static int max_steps;
+static bool vsync;
+
+/* frame clock is sum of elapsed time of all frames, so it can be recorded and replayed */
+static uint64_t frame_clock;
+
+/* state of random generator, seeded at startup */
+static uint64_t random_state;
+
+/* counters readable by scripts, mixer counters are copied from `mixer` on read */
+enum {
+  STAT_FRAMES, STAT_STEPS, STAT_DROPPED_STEPS, STAT_LATE_FRAMES,
+  STAT_LATENESS, STAT_MAX_LATENESS, STAT_MEAN_LATENESS,
+  STAT_MIX_TIME, STAT_MAX_MIX_TIME, STAT_MEAN_MIX_TIME, STAT_VOICES, STAT_MAX_VOICES,
+  STAT_UNDERRUNS, STAT_STREAM_UNDERRUNS, NUM_STATS
+};
+
+static struct { const char *name; double value; } stats[NUM_STATS] = {
+  [STAT_FRAMES]           = { "frames"           },
+  [STAT_STEPS]            = { "steps"            },
+  [STAT_DROPPED_STEPS]    = { "dropped-steps"    },
+  [STAT_LATE_FRAMES]      = { "late-frames"      },
+  [STAT_LATENESS]         = { "lateness"         },
+  [STAT_MAX_LATENESS]     = { "max-lateness"     },
+  [STAT_MEAN_LATENESS]    = { "mean-lateness"    },
+  [STAT_MIX_TIME]         = { "mix-time"         },
+  [STAT_MAX_MIX_TIME]     = { "max-mix-time"     },
+  [STAT_MEAN_MIX_TIME]    = { "mean-mix-time"    },
+  [STAT_VOICES]           = { "voices"           },
+  [STAT_MAX_VOICES]       = { "max-voices"       },
+  [STAT_UNDERRUNS]        = { "underruns"        },
+  [STAT_STREAM_UNDERRUNS] = { "stream-underruns" }
+};
+
+/* print counters at exit */
+static bool dump_stats;
 
 /* window */
 static SDL_Window *window;
@@ -52,41 +144,218 @@ static SDL_AudioSpec audio;
 /* virtual screen */
 static uint8_t *screen;
 static int width, height, scale;
+
+/* render target, screen or canvas */
+static struct { uint8_t *pixels; int pitch; Rect rect; Image *image; } target;
 static struct { elis_Number x, y; } camera;
-static struct { int x0, y0, x1, y1; } clip;
+static Rect clip;
+
+/* render threads, each renders horizontal band of virtual screen */
+#define MAX_THREADS 16
+
+static struct { SDL_Thread *thread; SDL_sem *start; } threads[MAX_THREADS];
+static SDL_sem *render_done;
+static int num_threads = 1;
+static bool deferred, render_final;
+
+/* drawing commands deferred until end of frame */
+static Command *commands;
+static int max_commands, num_commands;
+
+/* inverse mapping of rotated and scaled sprites, in 16.16 fixed point, indexed by commands */
+typedef struct { int u, v, du[2], dv[2]; } Transform;
+
+static Transform *transforms;
+static int max_transforms, num_transforms;
+
+/* particles drawn by single command */
+typedef struct { int x, y, c; } Point;
+
+static Point *points;
+static int max_points, num_points;
+
+/* palettes, `colors` are converted to window pixel format */
+#define MAX_PALETTES 8
+
+static SDL_Color base_colors[256], palettes[MAX_PALETTES][256];
+static uint32_t colors[MAX_PALETTES][256];
+static uint8_t *scanlines; /* palette of every screen row */
+static int num_colors, cur_palette;
+static SDL_PixelFormat *format;
+
+/* audio commands, sent by game thread to mixer through lock-free ring */
+#define AUDIO_QUEUE_SIZE 256
+
+enum { CMD_PLAY, CMD_RESUME, CMD_PAUSE, CMD_STOP, CMD_LIMIT };
+
+typedef struct {
+  int op; Sound *sound; bool music, timed; int gain[2]; uint32_t step; int limit, priority;
+  double now, delay; /* game time of command and delay of timed voice, in seconds */
+} AudioCommand;
+
+static AudioCommand audio_queue[AUDIO_QUEUE_SIZE];
+static SDL_atomic_t queue_head, queue_tail;
+
+/*
+ * voices are owned by mixer thread only, position and step are in 16.16 fixed point frames;
+ * playing voice is linked to list of its priority and list of its sound, free one -- to free list
+ */
+#define MAX_VOICES   64
+#define MAX_PRIORITY 8
+#define MAX_RATE     4
+#define UNIT_GAIN    (1 << 14)
+
+enum { BY_PRIORITY, BY_SOUND };
+
+typedef struct {
+  Sound *sound; uint64_t position; uint32_t step, delay; int gain[2]; bool music, paused;
+  int priority, prev[2], next[2];
+} Voice;
 
-/* fixed palette */
-static uint32_t colors[256];
-static int num_colors;
+static Voice voices[MAX_VOICES];
+static VoiceList active[MAX_PRIORITY + 1]; /* music has highest priority */
+static int free_voice;
 
-/* circle buffer of sound sources */
-static struct { Sound *sound; uint32_t position; } *sources;
-static int max_sources = 64, num_sources, next_source; 
+/*
+ * mixer clock (count of mixed frames) and counters are published for game thread by sequence lock;
+ * timed voices are placed by mapping of game time to mixer clock, which is kept while drift is small
+ */
+#define MAX_DRIFT 4 /* game clock may run ahead of mixer by 1/MAX_DRIFT of second */
+
+typedef struct {
+  uint64_t clock, callbacks, underruns, stream_underruns;
+  double time, max_time, mean_time; /* time spent in callback, in seconds */
+  int voices, max_voices;
+} Mixer;
+
+static Mixer mixer;
+static SDL_atomic_t mixer_seq;
+static uint64_t anchor_frame, last_callback;
+static double anchor_time;
+static bool anchored;
+static int starved; /* streams which ran out of samples during callback */
+
+/* voices are summed in 32 bits and clamped once, streams are gathered to `scratch` before mixing */
+static int32_t *mix_buffer;
+static int16_t *scratch;
+
+/* streams are refilled by `streamer` thread, `stream_lock` guards the list */
+static Stream *streams;
+static SDL_Thread *streamer;
+static SDL_sem *stream_wake;
+static SDL_mutex *stream_lock;
+static SDL_atomic_t streaming;
 
 /*
  * Userdata objects
  */
 
+static void flush(void);
+static void set_target(Image *image);
+static void drop_layouts(Image *font);
+static void push_command(AudioCommand cmd);
+static void drain_commands(void);
+
 static elis_Object *free_image(elis_State *S, elis_Object *obj) {
-  SDL_FreeSurface(elis_to_userdata(S, obj, NULL));
+  Image *image = elis_to_userdata(S, obj, NULL);
+  /* image may be used by deferred commands or be render target */
+  flush();
+  if (target.image == image) set_target(NULL);
+  drop_layouts(image);
+  SDL_FreeSurface(image->surface);
+  free(image->rows);
+  free(image->spans);
+  free(image);
   return NULL; 
 }
 
 static elis_Object *free_sound(elis_State *S, elis_Object *obj) {
   Sound *sound = elis_to_userdata(S, obj, NULL);
+  /* sound may be played or referenced by queued commands, so run them and stop it right now */
+  if (device) {
+    push_command((AudioCommand) { .op = CMD_STOP, .sound = sound });
+    SDL_LockAudioDevice(device);
+    drain_commands();
+    SDL_UnlockAudioDevice(device);
+  }
+  if (sound->stream) {
+    Stream *st = sound->stream;
+    SDL_LockMutex(stream_lock);
+    for (Stream **it = &streams; *it; it = &(*it)->next) {
+      if (*it == st) { *it = st->next; break; }
+    }
+    SDL_UnlockMutex(stream_lock);
+    SDL_RWclose(st->file);
+    SDL_FreeAudioStream(st->cvt);
+    free(st);
+  }
   free(sound->buffer);
   free(sound);
   return NULL;
 }
 
 static elis_Object *free_tilemap(elis_State *S, elis_Object *obj) {
-  free(elis_to_userdata(S, obj, NULL));
+  Tilemap *map = elis_to_userdata(S, obj, NULL);
+#ifdef __unix__
+  if (map->mapped) munmap(map->mapped, map->mapped_size);
+#endif
+  if (!map->mapped) free(map->tiles);
+  free(map->solid);
+  free(map);
   return NULL; 
 }
 
+static elis_Object *mark_grid(elis_State *S, elis_Object *obj) {
+  Grid *grid = elis_to_userdata(S, obj, NULL);
+  for (int i = 0; i < grid->num_entities; ++i) {
+    if (grid->entities[i].obj) elis_mark(S, grid->entities[i].obj);
+  }
+  return NULL;
+}
+
+static elis_Object *free_grid(elis_State *S, elis_Object *obj) {
+  Grid *grid = elis_to_userdata(S, obj, NULL);
+  for (int i = 0; i < GRID_BUCKETS; ++i) free(grid->buckets[i].entries);
+  free(grid->entities);
+  free(grid);
+  return NULL;
+}
+
+static elis_Object *mark_emitter(elis_State *S, elis_Object *obj) {
+  Emitter *em = elis_to_userdata(S, obj, NULL);
+  if (em->map_obj) elis_mark(S, em->map_obj);
+  return NULL;
+}
+
+static elis_Object *free_emitter(elis_State *S, elis_Object *obj) {
+  Emitter *em = elis_to_userdata(S, obj, NULL);
+  free(em->x);
+  free(em);
+  return NULL;
+}
+
 static elis_Handlers image_handlers   = { .free = free_image   };
 static elis_Handlers sound_handlers   = { .free = free_sound   };
 static elis_Handlers tilemap_handlers = { .free = free_tilemap };
+static elis_Handlers grid_handlers    = { .mark = mark_grid, .free = free_grid };
+static elis_Handlers emitter_handlers = { .mark = mark_emitter, .free = free_emitter };
+
+/* tiles are signed 8, 16 or 32 bit numbers */
+static inline int get_tile(const Tilemap *map, int i) {
+  switch (map->bits) {
+    case 8:  return ((int8_t *) map->tiles)[i];
+    case 16: return ((int16_t *) map->tiles)[i];
+    default: return ((int32_t *) map->tiles)[i];
+  }
+}
+
+static inline void set_tile(Tilemap *map, int i, int tile) {
+  switch (map->bits) {
+    case 8:  ((int8_t *) map->tiles)[i] = tile; break;
+    case 16: ((int16_t *) map->tiles)[i] = tile; break;
+    default: ((int32_t *) map->tiles)[i] = tile;
+  }
+}
 
 static void *to_userdata(elis_State *S, elis_Object *obj, elis_Handlers *type) {
   elis_Handlers *hdls = NULL;
@@ -106,7 +375,7 @@ static elis_Object *f_exit(elis_State *S, elis_Object *args) {
 
 static elis_Object *f_time(elis_State *S, elis_Object *args) {
   (void) args;
-  return elis_number(S, SDL_GetTicks() / 1000.0);
+  return elis_number(S, (elis_Number) frame_clock / SDL_GetPerformanceFrequency());
 }
 
 static elis_Object *load(elis_State *S, const char *filename) {
@@ -125,6 +394,45 @@ static elis_Object *load(elis_State *S, const char *filename) {
   return res;
 }
 
+static elis_Object *f_alpha(elis_State *S, elis_Object *args) {
+  (void) args;
+  return elis_number(S, (elis_Number) lag / time_step);
+}
+
+static Mixer get_mixer(void);
+
+static void update_stats(void) {
+  Mixer m = get_mixer();
+  stats[STAT_MIX_TIME].value = m.time;
+  stats[STAT_MAX_MIX_TIME].value = m.max_time;
+  stats[STAT_MEAN_MIX_TIME].value = m.mean_time;
+  stats[STAT_VOICES].value = m.voices;
+  stats[STAT_MAX_VOICES].value = m.max_voices;
+  stats[STAT_UNDERRUNS].value = m.underruns;
+  stats[STAT_STREAM_UNDERRUNS].value = m.stream_underruns;
+}
+
+static elis_Object *f_stats(elis_State *S, elis_Object *args) {
+  update_stats();
+  /* get single counter */
+  if (!elis_nil(S, args)) {
+    const char *name = elis_to_string(S, elis_next_arg(S, &args));
+    for (int i = 0; i < NUM_STATS; ++i) {
+      if (!strcmp(stats[i].name, name)) return elis_number(S, stats[i].value);
+    }
+    return elis_bool(S, false);
+  }
+  /* or list of all counters as `(name . value)` pairs */
+  elis_Object *lst = elis_bool(S, false);
+  int gc = elis_save_gc(S);
+  for (int i = NUM_STATS; i-- > 0; ) {
+    lst = elis_cons(S, elis_cons(S, elis_symbol(S, stats[i].name), elis_number(S, stats[i].value)), lst);
+    elis_restore_gc(S, gc);
+    elis_push_gc(S, lst);
+  }
+  return lst;
+}
+
 static elis_Object *f_load(elis_State *S, elis_Object *args) {
   return load(S, elis_to_string(S, elis_next_arg(S, &args)));
 }
@@ -176,9 +484,17 @@ static elis_Object *f_sort(elis_State *S, elis_Object *args) {
   return lst;
 }
 
+static uint64_t next_random(void) {
+  /* splitmix64, any seed is good and sequence is same on all platforms */
+  uint64_t z = (random_state += 0x9e3779b97f4a7c15ull);
+  z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ull;
+  z = (z ^ (z >> 27)) * 0x94d049bb133111ebull;
+  return z ^ (z >> 31);
+}
+
 static elis_Object *f_random(elis_State *S, elis_Object *args) {
   /* generate random number from 0 to 1 */
-  elis_Number x = rand() / (elis_Number) RAND_MAX;
+  elis_Number x = (next_random() >> 11) / 9007199254740992.0;
   if (elis_nil(S, args)) return elis_number(S, x);
   /* generate random number from 0 to n */
   elis_Number n = elis_to_number(S, elis_next_arg(S, &args));
@@ -188,6 +504,484 @@ static elis_Object *f_random(elis_State *S, elis_Object *args) {
   return elis_number(S, n + x * (m - n));
 } 
 
+/*
+ * Rendering
+ */
+
+static inline Rect intersect(Rect a, Rect b) {
+  return (Rect) {
+    a.x0 > b.x0 ? a.x0 : b.x0, a.y0 > b.y0 ? a.y0 : b.y0,
+    a.x1 < b.x1 ? a.x1 : b.x1, a.y1 < b.y1 ? a.y1 : b.y1
+  };
+}
+
+#define EMPTY(r) ((r).x0 >= (r).x1 || (r).y0 >= (r).y1)
+
+/* row kinds of span-encoded image */
+enum { ROW_EMPTY, ROW_SOLID, ROW_MIXED };
+
+/* mixed rows with more spans than this are blended per pixel instead of copied by spans */
+#define MAX_ROW_SPANS 2
+
+static void encode_spans(Image *image) {
+  SDL_Surface *surface = image->surface;
+  int w = surface->w, h = surface->h;
+  /* worst case is every second pixel opaque */
+  image->rows = realloc(image->rows, h * sizeof(*image->rows));
+  image->spans = realloc(image->spans, h * (w / 2 + 1) * sizeof(*image->spans));
+  uint32_t num_spans = 0;
+  for (int y = 0; y < h; ++y) {
+    const uint8_t *src = (uint8_t *) surface->pixels + y * surface->pitch;
+    Row *row = &image->rows[y];
+    row->first = num_spans;
+    /* collect runs of opaque pixels */
+    for (int x = 0; x < w; ) {
+      while (x < w && src[x] == image->key) ++x;
+      if (x == w) break;
+      Span *span = &image->spans[num_spans++];
+      for (span->x = x; x < w && src[x] != image->key; ) ++x;
+      span->len = x - span->x;
+    }
+    row->count = num_spans - row->first;
+    row->kind = row->count == 0 ? ROW_EMPTY
+              : row->count == 1 && image->spans[row->first].len == w ? ROW_SOLID
+              : ROW_MIXED;
+  }
+  image->spans = realloc(image->spans, (num_spans ? num_spans : 1) * sizeof(*image->spans));
+}
+
+static inline void blend_row(uint8_t *dst, const uint8_t *src, int n, uint8_t key) {
+  int i = 0;
+#ifdef __SSE2__
+  /* masked store of 16 pixels at once */
+  const __m128i k = _mm_set1_epi8(key);
+  for (; i + 16 <= n; i += 16) {
+    __m128i s = _mm_loadu_si128((const __m128i *) (src + i));
+    __m128i d = _mm_loadu_si128((const __m128i *) (dst + i));
+    __m128i m = _mm_cmpeq_epi8(s, k);
+    _mm_storeu_si128((__m128i *) (dst + i), _mm_or_si128(_mm_and_si128(m, d), _mm_andnot_si128(m, s)));
+  }
+#endif
+  for (; i < n; ++i) dst[i] = src[i] != key ? src[i] : dst[i];
+}
+
+static inline void mirror_row(uint8_t *dst, const uint8_t *src, int n, int key) {
+  for (int i = 0; i < n; ++i) {
+    uint8_t c = src[n - 1 - i];
+    if (c != key) dst[i] = c;
+  }
+}
+
+/* flip flags of sprite */
+enum { FLIP_X = 1, FLIP_Y = 2 };
+
+static void raster_draw(const Command *cmd, Rect r) {
+  Image *image = cmd->image;
+  SDL_Surface *surface = image->surface;
+  int w = r.x1 - r.x0, h = r.y1 - r.y0, sx = r.x0 - cmd->x, sx1 = sx + w, sy = cmd->s + r.y0 - cmd->y, step = 1;
+  /* flipped sprite is read from bottom to top and (or) from right to left */
+  if (cmd->c & FLIP_Y) sy = cmd->s + image->size - 1 - (r.y0 - cmd->y), step = -1;
+  if (cmd->c & FLIP_X) sx = surface->w - sx1;
+  /* copy scanlines from sprite to render target */
+  uint8_t *dst = target.pixels + r.x0 + r.y0 * target.pitch;
+  uint8_t *src = (uint8_t *) surface->pixels + sy * surface->pitch;
+  const Row *row = image->rows + sy;
+  for (; h-- > 0; row += step, dst += target.pitch, src += step * surface->pitch) {
+    switch (row->kind) {
+      case ROW_EMPTY:
+        break;
+      case ROW_SOLID:
+        if (cmd->c & FLIP_X) mirror_row(dst, src + sx, w, -1);
+        else memcpy(dst, src + sx, w);
+        break;
+      default:
+        if (cmd->c & FLIP_X) {
+          mirror_row(dst, src + sx, w, image->key);
+          break;
+        }
+        if (row->count > MAX_ROW_SPANS) {
+          blend_row(dst, src + sx, w, image->key);
+          break;
+        }
+        /* copy opaque runs, clipped to visible part of row */
+        for (const Span *span = image->spans + row->first, *end = span + row->count; span < end; ++span) {
+          int x0 = span->x > sx ? span->x : sx, x1 = span->x + span->len < sx1 ? span->x + span->len : sx1;
+          if (x0 < x1) memcpy(dst + x0 - sx, src + x0, x1 - x0);
+        }
+    }
+  }
+}
+
+static void raster_transform(const Command *cmd, Rect r) {
+  const Transform *t = &transforms[cmd->c];
+  Image *image = cmd->image;
+  SDL_Surface *surface = image->surface;
+  int dx = r.x0 - cmd->x, dy = r.y0 - cmd->y, w = r.x1 - r.x0;
+  int u = t->u + dx * t->du[0] + dy * t->du[1], v = t->v + dx * t->dv[0] + dy * t->dv[1];
+  /* step through sprite by inverse mapping of every target pixel */
+  uint8_t *dst = target.pixels + r.x0 + r.y0 * target.pitch;
+  const uint8_t *src = (uint8_t *) surface->pixels + cmd->s * surface->pitch;
+  for (int y = r.y0; y < r.y1; ++y, dst += target.pitch, u += t->du[1], v += t->dv[1]) {
+    for (int x = 0, pu = u, pv = v; x < w; ++x, pu += t->du[0], pv += t->dv[0]) {
+      /* negative coordinates are rejected by unsigned compare */
+      unsigned su = pu >> 16, sv = pv >> 16;
+      if (su < (unsigned) surface->w && sv < (unsigned) image->size) {
+        uint8_t c = src[su + sv * surface->pitch];
+        if (c != image->key) dst[x] = c;
+      }
+    }
+  }
+}
+
+static void raster_rect(const Command *cmd, Rect r) {
+  uint8_t *row = target.pixels + r.x0 + r.y0 * target.pitch;
+  for (; r.y0++ < r.y1; row += target.pitch) memset(row, cmd->c, r.x1 - r.x0);
+}
+
+static void raster_points(const Command *cmd, Rect r) {
+  /* `x` is first point, `y` is number of points and `s` is their size */
+  for (const Point *p = points + cmd->x, *end = p + cmd->y; p < end; ++p) {
+    Rect pr = intersect((Rect) { p->x, p->y, p->x + cmd->s, p->y + cmd->s }, r);
+    if (EMPTY(pr)) continue;
+    uint8_t *row = target.pixels + pr.x0 + pr.y0 * target.pitch;
+    for (; pr.y0 < pr.y1; ++pr.y0, row += target.pitch) memset(row, p->c, pr.x1 - pr.x0);
+  }
+}
+
+/*
+ * Deferred rendering
+ */
+
+static void submit(const Command *cmd) {
+  if (EMPTY(cmd->bounds)) return;
+  /* draw immediately if there are no render threads */
+  if (!deferred) {
+    cmd->func(cmd, cmd->bounds);
+    return;
+  }
+  /* time to strech command list? */
+  if (num_commands == max_commands) {
+    max_commands = max_commands ? max_commands << 1 : 1024;
+    commands = realloc(commands, max_commands * sizeof(*commands));
+  }
+  commands[num_commands++] = *cmd;
+}
+
+static void convert(int y0, int y1) {
+  for (int y = y0; y < y1; ++y) {
+    const uint32_t *lut = colors[scanlines[y]];
+    const uint8_t *src = screen + y * width;
+    uint32_t *dst = pixels + y * width;
+    for (int x = 0; x < width; ++x) dst[x] = lut[src[x]];
+  }
+}
+
+static void render_band(int band, bool final) {
+  int y0 = height * band / num_threads, y1 = height * (band + 1) / num_threads;
+  /* replay recorded commands clipped to band */
+  Rect rect = { 0, y0, width, y1 };
+  for (int i = 0; i < num_commands; ++i) {
+    Rect r = intersect(commands[i].bounds, rect);
+    if (!EMPTY(r)) commands[i].func(&commands[i], r);
+  }
+  /* convert band of virtual framebuffer to window pixels */
+  if (final) convert(y0, y1);
+}
+
+static int render_thread(void *udata) {
+  int band = (intptr_t) udata;
+  for (;;) {
+    SDL_SemWait(threads[band].start);
+    if (!threads[band].thread) return 0;
+    render_band(band, render_final);
+    SDL_SemPost(render_done);
+  }
+}
+
+static void render(bool final) {
+  /* main thread renders first band, others are rendered by thread pool */
+  render_final = final;
+  for (int i = 1; i < num_threads; ++i) SDL_SemPost(threads[i].start);
+  render_band(0, final);
+  for (int i = 1; i < num_threads; ++i) SDL_SemWait(render_done);
+  num_commands = num_transforms = num_points = 0;
+}
+
+static void flush(void) {
+  if (num_commands) render(false);
+}
+
+static void start_threads(int num) {
+  num_threads = num;
+  set_target(NULL);
+  render_done = SDL_CreateSemaphore(0);
+  for (int i = 1; i < num_threads; ++i) {
+    threads[i].start = SDL_CreateSemaphore(0);
+    threads[i].thread = SDL_CreateThread(render_thread, "render", (void *) (intptr_t) i);
+    if (!threads[i].thread) elis_error(S, SDL_GetError());
+  }
+}
+
+static void stop_threads(void) {
+  num_commands = num_transforms = num_points = 0;
+  for (int i = 1; i < num_threads; ++i) {
+    SDL_Thread *thread = threads[i].thread;
+    threads[i].thread = NULL;
+    SDL_SemPost(threads[i].start);
+    SDL_WaitThread(thread, NULL);
+    SDL_DestroySemaphore(threads[i].start);
+  }
+  SDL_DestroySemaphore(render_done);
+  num_threads = 1;
+  deferred = false;
+}
+
+static void draw(Image *image, int x, int y, int s, int flip) {
+  int w = image->surface->w, h = image->surface->h, size = image->size;
+  /* canvas was drawn on since last use? */
+  if (image->dirty) {
+    encode_spans(image);
+    image->dirty = false;
+  }
+  /* pass first scanline of sprite in spritesheet */
+  Command cmd = { raster_draw, intersect((Rect) { x, y, x + w, y + size }, clip), image, x, y, (s * size % h + h) % h, flip };
+  submit(&cmd);
+}
+
+static void blit(Image *image, int x, int y, int s, double angle, double sx, double sy) {
+  int w = image->surface->w, h = image->surface->h, size = image->size;
+  if (sx == 0 || sy == 0) return;
+  /* bounds of sprite rotated around its center */
+  double c = cos(angle), sn = sin(angle), cx = x + w / 2.0, cy = y + size / 2.0;
+  double hw = (fabs(c * sx) * w + fabs(sn * sy) * size) / 2, hh = (fabs(sn * sx) * w + fabs(c * sy) * size) / 2;
+  Rect bounds = { floor(cx - hw), floor(cy - hh), ceil(cx + hw), ceil(cy + hh) };
+  /* sprite coordinates of first target pixel center and their steps */
+  double dx = bounds.x0 + 0.5 - cx, dy = bounds.y0 + 0.5 - cy;
+  if (num_transforms == max_transforms) {
+    max_transforms = max_transforms ? max_transforms << 1 : 64;
+    transforms = realloc(transforms, max_transforms * sizeof(*transforms));
+  }
+  transforms[num_transforms] = (Transform) {
+    lround(((c * dx + sn * dy) / sx + w / 2.0) * 65536),
+    lround(((c * dy - sn * dx) / sy + size / 2.0) * 65536),
+    { lround(c / sx * 65536), lround(sn / sx * 65536) },
+    { lround(-sn / sy * 65536), lround(c / sy * 65536) }
+  };
+  Command cmd = { raster_transform, intersect(bounds, clip), image, bounds.x0, bounds.y0, (s * size % h + h) % h, num_transforms++ };
+  submit(&cmd);
+  /* transform is kept only for deferred command */
+  if (!deferred) num_transforms = 0;
+}
+
+static void set_target(Image *image) {
+  /* finish drawing recorded for screen */
+  flush();
+  target.image = image;
+  if (image) {
+    /* canvas is drawn immediately and should be re-encoded before blitting */
+    target.pixels = image->surface->pixels;
+    target.pitch = image->surface->pitch;
+    target.rect = (Rect) { 0, 0, image->surface->w, image->surface->h };
+    image->dirty = true;
+  } else {
+    target.pixels = screen;
+    target.pitch = width;
+    target.rect = (Rect) { 0, 0, width, height };
+  }
+  deferred = !image && num_threads > 1;
+  clip = target.rect;
+}
+
+static void span(int x0, int x1, int y, int c) {
+  Command cmd = { raster_rect, intersect((Rect) { x0, y, x1, y + 1 }, clip), NULL, 0, 0, 0, c };
+  submit(&cmd);
+}
+
+/* first step of line, at which minor offset `(2 * i * d + n) / (2 * n)` reaches `m` */
+static inline int64_t line_step(int64_t m, int64_t d, int64_t n) {
+  int64_t a = 2 * n * m - n, b = 2 * d;
+  return a <= 0 ? -(-a / b) : (a + b - 1) / b;
+}
+
+/* range of offsets from `p` in direction `s`, that stay inside of [lo, hi) */
+static inline void line_range(int p, int s, int lo, int hi, int64_t *k0, int64_t *k1) {
+  *k0 = s > 0 ? (int64_t) lo - p : (int64_t) p - (hi - 1);
+  *k1 = s > 0 ? (int64_t) hi - 1 - p : (int64_t) p - lo;
+}
+
+static void line(int x0, int y0, int x1, int y1, int c) {
+  /* step along major axis, minor offset of step `i` is rounded `i * d / n` */
+  int sx = x0 < x1 ? 1 : -1, sy = y0 < y1 ? 1 : -1;
+  int64_t dx = llabs((int64_t) x1 - x0), dy = llabs((int64_t) y1 - y0);
+  bool steep = dy > dx;
+  int64_t n = steep ? dy : dx, d = steep ? dx : dy;
+  /* clip steps by major axis, then by minor axis */
+  int64_t i0, i1, m0, m1;
+  if (steep) {
+    line_range(y0, sy, clip.y0, clip.y1, &i0, &i1);
+    line_range(x0, sx, clip.x0, clip.x1, &m0, &m1);
+  } else {
+    line_range(x0, sx, clip.x0, clip.x1, &i0, &i1);
+    line_range(y0, sy, clip.y0, clip.y1, &m0, &m1);
+  }
+  if (i0 < 0) i0 = 0;
+  if (i1 > n) i1 = n;
+  if (d == 0) {
+    if (m0 > 0 || m1 < 0) return;
+  } else {
+    if (m0 > 0 && line_step(m0, d, n) > i0) i0 = line_step(m0, d, n);
+    if (m1 < d && line_step(m1 + 1, d, n) - 1 < i1) i1 = line_step(m1 + 1, d, n) - 1;
+  }
+  if (i0 > i1) return;
+  if (steep) {
+    /* every row has single pixel */
+    for (int64_t i = i0; i <= i1; ++i) {
+      int x = x0 + sx * ((2 * i * d + n) / (2 * n));
+      span(x, x + 1, y0 + sy * i, c);
+    }
+  } else {
+    /* every row is single span of steps with same minor offset */
+    for (int64_t m = d ? (2 * i0 * d + n) / (2 * n) : 0, i = i0; i <= i1; ++m) {
+      int64_t last = d ? line_step(m + 1, d, n) - 1 : i1;
+      if (last > i1) last = i1;
+      int xa = x0 + sx * i, xb = x0 + sx * last;
+      span(xa < xb ? xa : xb, (xa > xb ? xa : xb) + 1, y0 + sy * m, c);
+      i = last + 1;
+    }
+  }
+}
+
+static inline int half_width(int rx, int ry, int dy) {
+  if (dy < 0) dy = -dy;
+  if (dy > ry) return -1;
+  double r = rx + 0.5, t = dy / (ry + 0.5);
+  return sqrt(r * r * (1 - t * t));
+}
+
+static void ellipse(int x, int y, int rx, int ry, bool filled, int c) {
+  if (rx < 0 || ry < 0) return;
+  /* visit only visible rows */
+  int dy0 = y - ry < clip.y0 ? clip.y0 - y : -ry, dy1 = y + ry >= clip.y1 ? clip.y1 - 1 - y : ry;
+  for (int dy = dy0; dy <= dy1; ++dy) {
+    int a = half_width(rx, ry, dy);
+    if (filled) {
+      span(x - a, x + a + 1, y + dy, c);
+    } else {
+      /* outline covers row from its end to the end of next outer row */
+      int b = half_width(rx, ry, dy < 0 ? dy - 1 : dy + 1), n = a - b > 1 ? a - b : 1;
+      span(x - a, x - a + n, y + dy, c);
+      span(x + a + 1 - n, x + a + 1, y + dy, c);
+    }
+  }
+}
+
+static void polygon(const elis_Number *xs, const elis_Number *ys, int n, int c) {
+  if (n < 3) return;
+  elis_Number top = ys[0], bottom = ys[0];
+  for (int i = 1; i < n; ++i) {
+    if (ys[i] < top) top = ys[i];
+    if (ys[i] > bottom) bottom = ys[i];
+  }
+  /* sample every visible row at pixel centers */
+  int y0 = ceil(top - 0.5), y1 = ceil(bottom - 0.5);
+  if (y0 < clip.y0) y0 = clip.y0;
+  if (y1 > clip.y1) y1 = clip.y1;
+  for (int y = y0; y < y1; ++y) {
+    elis_Number yc = y + 0.5, left = HUGE_VAL, right = -HUGE_VAL;
+    /* convex polygon crosses every row at most twice */
+    for (int i = 0, j = n - 1; i < n; j = i++) {
+      if ((ys[j] <= yc && yc < ys[i]) || (ys[i] <= yc && yc < ys[j])) {
+        elis_Number xc = xs[j] + (yc - ys[j]) * (xs[i] - xs[j]) / (ys[i] - ys[j]);
+        if (xc < left) left = xc;
+        if (xc > right) right = xc;
+      }
+    }
+    if (left < right) span(ceil(left - 0.5), ceil(right - 0.5), y, c);
+  }
+}
+
+/*
+ * Text layout
+ */
+
+/* laid out strings are cached, so static text costs only drawing */
+#define LAYOUT_CACHE_SIZE 256
+
+typedef struct { int x, y, sprite; } Glyph;
+typedef struct { Image *font; char *string; int wrap, align, width, height, count; Glyph *glyphs; } Layout;
+
+static Layout layouts[LAYOUT_CACHE_SIZE];
+
+static void drop_layouts(Image *font) {
+  for (int i = 0; i < LAYOUT_CACHE_SIZE; ++i) {
+    if (layouts[i].font == font) {
+      free(layouts[i].string);
+      free(layouts[i].glyphs);
+      layouts[i] = (Layout) { 0 };
+    }
+  }
+}
+
+static int next_line(const char *str, int cols, int *len) {
+  /* returns number of consumed chars, `len` is visible length of line */
+  int i = 0, space = -1, n;
+  for (; str[i] && str[i] != '\n' && i < cols; ++i) {
+    if (str[i] == ' ') space = i;
+  }
+  if (!str[i] || str[i] == '\n') {
+    *len = i;
+    return i + (str[i] == '\n');
+  }
+  if (str[i] == ' ') {
+    n = i + 1;
+  } else if (space > 0) {
+    i = space, n = space + 1;
+  } else {
+    n = i; /* word is longer than line */
+  }
+  /* spaces at wrap point aren't drawn */
+  while (i > 0 && str[i - 1] == ' ') --i;
+  *len = i;
+  return n;
+}
+
+static Layout *layout(Image *font, const char *str, int wrap, int align) {
+  /* look up cache by hash of font, string and layout options */
+  uint32_t hash = 2166136261u ^ (uintptr_t) font ^ wrap * 31 ^ align;
+  for (const char *p = str; *p; ++p) hash = (hash ^ (uint8_t) *p) * 16777619u;
+  Layout *l = &layouts[hash % LAYOUT_CACHE_SIZE];
+  if (l->font == font && l->wrap == wrap && l->align == align && !strcmp(l->string, str)) return l;
+  /* replace cached layout */
+  free(l->string);
+  free(l->glyphs);
+  int size = font->surface->w, cols = wrap >= size ? wrap / size : wrap > 0 ? 1 : INT32_MAX;
+  int len = strlen(str), lines = 0, width = 0;
+  *l = (Layout) { font, strcpy(malloc(len + 1), str), wrap, align, 0, 0, 0, malloc(len * sizeof(Glyph) + 1) };
+  /* measure lines, then place glyphs aligned within widest line or wrap width */
+  for (int i = 0, n; str[i]; ++lines) {
+    i += next_line(str + i, cols, &n);
+    if (n * size > width) width = n * size;
+  }
+  if (wrap > 0 && wrap > width) width = wrap;
+  for (int i = 0, y = 0, n; str[i]; y += font->size) {
+    int next = next_line(str + i, cols, &n), x = (width - n * size) * align / 2;
+    for (int j = 0; j < n; ++j, x += size) {
+      char c = str[i + j];
+      /* space is drawn too, fonts may have non-blank glyph for it */
+      if (c >= ' ' && c <= '~') l->glyphs[l->count++] = (Glyph) { x, y, c - 32 };
+    }
+    i += next;
+  }
+  l->width = width;
+  l->height = lines * font->size;
+  return l;
+}
+
+static void draw_text(Image *font, int x, int y, const char *str, int wrap, int align) {
+  Layout *l = layout(font, str, wrap, align);
+  for (int i = 0; i < l->count; ++i) draw(font, x + l->glyphs[i].x, y + l->glyphs[i].y, l->glyphs[i].sprite, 0);
+}
+
 /*
  * API: graphics
  */
@@ -195,270 +989,1825 @@ static elis_Object *f_random(elis_State *S, elis_Object *args) {
 static elis_Object *f_clear(elis_State *S, elis_Object *args) {
   int col = elis_to_number(S, elis_next_arg(S, &args));
   if (elis_nil(S, args)) {
-    memset(screen, col % num_colors, width * height);
+    Command cmd = { raster_rect, target.rect, NULL, 0, 0, 0, col % num_colors };
+    submit(&cmd);
+  } else {
+    Tilemap *map = to_userdata(S, elis_next_arg(S, &args), &tilemap_handlers);
+    for (int i = 0; i < map->width * map->height; ++i) set_tile(map, i, col);
+  }
+  return elis_bool(S, false);
+}
+
+static inline Rect map_rect(Tilemap *map, int x, int y, int w, int h) {
+  return intersect((Rect) { x, y, x + w, y + h }, (Rect) { 0, 0, map->width, map->height });
+}
+
+static elis_Object *f_fill(elis_State *S, elis_Object *args) {
+  int c = elis_to_number(S, elis_next_arg(S, &args));
+  int x = elis_to_number(S, elis_next_arg(S, &args));
+  int y = elis_to_number(S, elis_next_arg(S, &args));
+  switch (elis_type(S, elis_car(S, args))) {
+    case ELIS_NUMBER: {
+      int w = elis_to_number(S, elis_next_arg(S, &args));
+      int h = elis_to_number(S, elis_next_arg(S, &args));
+      /* fill rect of tiles */
+      if (!elis_nil(S, args)) {
+        Tilemap *map = to_userdata(S, elis_next_arg(S, &args), &tilemap_handlers);
+        Rect r = map_rect(map, x, y, w, h);
+        for (int ty = r.y0; ty < r.y1; ++ty) {
+          for (int tx = r.x0; tx < r.x1; ++tx) set_tile(map, tx + ty * map->width, c);
+        }
+        break;
+      }
+      x += camera.x, y += camera.y;
+      Command cmd = { raster_rect, intersect((Rect) { x, y, x + w, y + h }, clip), NULL, 0, 0, 0, c % num_colors };
+      submit(&cmd);
+      break;
+    }
+    case ELIS_USERDATA: {
+      Tilemap *map = to_userdata(S, elis_next_arg(S, &args), &tilemap_handlers);
+      if (x >= 0 && x < map->width && y >= 0 && y < map->height) set_tile(map, x + y * map->width, c);
+      break;
+    }
+    default: elis_error(S, "expected number or map");
+  }
+  return elis_bool(S, false);
+}
+
+static elis_Object *f_peek(elis_State *S, elis_Object *args) {
+  int x = elis_to_number(S, elis_next_arg(S, &args));
+  int y = elis_to_number(S, elis_next_arg(S, &args));
+  int w = 1, h = 1;
+  bool single = elis_type(S, elis_car(S, args)) != ELIS_NUMBER;
+  if (!single) {
+    w = elis_to_number(S, elis_next_arg(S, &args));
+    h = elis_to_number(S, elis_next_arg(S, &args));
+  }
+  /* read tiles or pixels of render target, outer ones are 0 */
+  Tilemap *map = elis_nil(S, args) ? NULL : to_userdata(S, elis_next_arg(S, &args), &tilemap_handlers);
+  if (!map) flush();
+  Rect r = map ? map_rect(map, 0, 0, map->width, map->height) : target.rect;
+  elis_Object *lst = elis_bool(S, false);
+  int gc = elis_save_gc(S);
+  for (int py = y + h; py-- > y; ) {
+    for (int px = x + w; px-- > x; ) {
+      int val = px < r.x0 || px >= r.x1 || py < r.y0 || py >= r.y1 ? 0
+              : map ? get_tile(map, px + py * map->width)
+              : target.pixels[px + py * target.pitch];
+      if (single) return elis_number(S, val);
+      lst = elis_cons(S, elis_number(S, val), lst);
+      elis_restore_gc(S, gc);
+      elis_push_gc(S, lst);
+    }
+  }
+  return lst;
+}
+
+static void copy_rows(uint8_t *dst, const uint8_t *src, int pitch, int len, int rows, bool up) {
+  /* rows are copied in order safe for overlapping rects */
+  if (up) {
+    dst += (rows - 1) * pitch, src += (rows - 1) * pitch, pitch = -pitch;
+  }
+  for (; rows-- > 0; dst += pitch, src += pitch) memmove(dst, src, len);
+}
+
+static elis_Object *f_copy(elis_State *S, elis_Object *args) {
+  int x = elis_to_number(S, elis_next_arg(S, &args));
+  int y = elis_to_number(S, elis_next_arg(S, &args));
+  int w = elis_to_number(S, elis_next_arg(S, &args));
+  int h = elis_to_number(S, elis_next_arg(S, &args));
+  int dx = elis_to_number(S, elis_next_arg(S, &args));
+  int dy = elis_to_number(S, elis_next_arg(S, &args));
+  /* copy tiles within map or from other map */
+  if (!elis_nil(S, args)) {
+    Tilemap *dst = to_userdata(S, elis_next_arg(S, &args), &tilemap_handlers);
+    Tilemap *src = elis_nil(S, args) ? dst : to_userdata(S, elis_next_arg(S, &args), &tilemap_handlers);
+    Rect r = map_rect(src, x, y, w, h);
+    r = map_rect(dst, r.x0 + dx - x, r.y0 + dy - y, r.x1 - r.x0, r.y1 - r.y0);
+    if (EMPTY(r)) return elis_bool(S, false);
+    if (dst->bits == src->bits) {
+      int size = dst->bits / 8;
+      copy_rows((uint8_t *) dst->tiles + (r.x0 + r.y0 * dst->width) * size,
+                (uint8_t *) src->tiles + (r.x0 + x - dx + (r.y0 + y - dy) * src->width) * size,
+                dst->width * size, (r.x1 - r.x0) * size, r.y1 - r.y0, dst == src && dy > y);
+      return elis_bool(S, false);
+    }
+    /* maps with different tile size can't overlap */
+    for (int ty = r.y0; ty < r.y1; ++ty) {
+      for (int tx = r.x0; tx < r.x1; ++tx) {
+        set_tile(dst, tx + ty * dst->width, get_tile(src, tx + x - dx + (ty + y - dy) * src->width));
+      }
+    }
+    return elis_bool(S, false);
+  }
+  /* or pixels of render target, source is clipped by target and destination by clip rect */
+  Rect r = intersect((Rect) { x, y, x + w, y + h }, target.rect);
+  r = intersect((Rect) { r.x0 + dx - x, r.y0 + dy - y, r.x1 + dx - x, r.y1 + dy - y }, clip);
+  if (EMPTY(r)) return elis_bool(S, false);
+  flush();
+  copy_rows(target.pixels + r.x0 + r.y0 * target.pitch, target.pixels + r.x0 + x - dx + (r.y0 + y - dy) * target.pitch,
+            target.pitch, r.x1 - r.x0, r.y1 - r.y0, dy > y);
+  return elis_bool(S, false);
+}
+
+typedef struct { int x, y, sprite, order; } Sprite;
+
+static int compare_sprites(const void *a, const void *b) {
+  const Sprite *p = a, *q = b;
+  return p->y != q->y ? (p->y > q->y) - (p->y < q->y) : p->order - q->order;
+}
+
+static void draw_batch(elis_State *S, Image *image, int x, int y, elis_Object *lst, bool sorted) {
+  /* draw sprites straight from list of `x y sprite` triples */
+  if (!sorted) {
+    while (!elis_nil(S, lst)) {
+      int px = x + elis_to_number(S, elis_next_arg(S, &lst));
+      int py = y + elis_to_number(S, elis_next_arg(S, &lst));
+      draw(image, px, py, elis_to_number(S, elis_next_arg(S, &lst)), 0);
+    }
+    return;
+  }
+  /* or collect them to plain array and draw ordered by y */
+  static Sprite *batch;
+  static size_t cap;
+  size_t len = 0;
+  while (!elis_nil(S, lst)) {
+    if (len == cap) {
+      cap = cap ? cap << 1 : 64;
+      batch = realloc(batch, cap * sizeof(*batch));
+    }
+    batch[len].x = x + elis_to_number(S, elis_next_arg(S, &lst));
+    batch[len].y = y + elis_to_number(S, elis_next_arg(S, &lst));
+    batch[len].sprite = elis_to_number(S, elis_next_arg(S, &lst));
+    batch[len].order = len;
+    ++len;
+  }
+  qsort(batch, len, sizeof(*batch), compare_sprites);
+  for (size_t i = 0; i < len; ++i) draw(image, batch[i].x, batch[i].y, batch[i].sprite, 0);
+}
+
+static int to_flip(elis_State *S, elis_Object *obj) {
+  int flip = 0;
+  if (elis_nil(S, obj)) return flip;
+  for (const char *str = elis_to_string(S, obj); *str; ++str) {
+    switch (*str) {
+      case 'X': case 'x': flip |= FLIP_X; break;
+      case 'Y': case 'y': flip |= FLIP_Y; break;
+      default: elis_error(S, "expected x, y or xy");
+    }
+  }
+  return flip;
+}
+
+static elis_Object *f_draw(elis_State *S, elis_Object *args) {
+  int x = elis_to_number(S, elis_next_arg(S, &args)) + camera.x;
+  int y = elis_to_number(S, elis_next_arg(S, &args)) + camera.y;
+  Image *image = to_userdata(S, elis_next_arg(S, &args), &image_handlers);
+  if (image == target.image) elis_error(S, "can't draw canvas on itself");
+  int size = image->surface->w;
+  elis_Object *rest = args;
+  args = elis_next_arg(S, &rest);
+  switch (elis_type(S, args)) {
+    case ELIS_NUMBER:
+      draw(image, x, y, elis_to_number(S, args), to_flip(S, elis_car(S, rest)));
+      break;
+    case ELIS_STRING:
+      draw_text(image, x, y, elis_to_string(S, args), 0, 0);
+      break;
+    case ELIS_USERDATA: {
+      elis_Handlers *type = NULL;
+      elis_to_userdata(S, args, &type);
+      if (type == &emitter_handlers) {
+        /* particles are sprites */
+        Emitter *em = to_userdata(S, args, &emitter_handlers);
+        for (int i = 0; i < em->count; ++i) draw(image, x + em->x[i], y + em->y[i], em->c[i], 0);
+        break;
+      }
+      Tilemap *map = to_userdata(S, args, &tilemap_handlers);
+      for (int ty = 0, py = y; ty < map->height; ++ty, py += image->size) {
+        for (int tx = 0, px = x; tx < map->width; ++tx, px += size) {
+          draw(image, px, py, get_tile(map, tx + ty * map->width), 0);
+        }
+      }
+      break;
+    }
+    case ELIS_NIL:
+    case ELIS_PAIR:
+      draw_batch(S, image, x, y, args, !elis_nil(S, elis_car(S, rest)));
+      break;
+    default: elis_error(S, "expected number, string, map, emitter or list");
+  }
+  return elis_bool(S, false);
+}
+
+static elis_Object *f_blit(elis_State *S, elis_Object *args) {
+  int x = elis_to_number(S, elis_next_arg(S, &args)) + camera.x;
+  int y = elis_to_number(S, elis_next_arg(S, &args)) + camera.y;
+  Image *image = to_userdata(S, elis_next_arg(S, &args), &image_handlers);
+  if (image == target.image) elis_error(S, "can't draw canvas on itself");
+  int s = elis_to_number(S, elis_next_arg(S, &args));
+  elis_Number angle = elis_to_number(S, elis_next_arg(S, &args));
+  elis_Number sx = elis_nil(S, args) ? 1 : elis_to_number(S, elis_next_arg(S, &args));
+  elis_Number sy = elis_nil(S, args) ? sx : elis_to_number(S, elis_next_arg(S, &args));
+  blit(image, x, y, s, angle, sx, sy);
+  return elis_bool(S, false);
+}
+
+static int to_align(elis_State *S, elis_Object *obj) {
+  if (elis_nil(S, obj)) return 0;
+  switch (*elis_to_string(S, obj)) {
+    case 'L': case 'l': return 0;
+    case 'C': case 'c': return 1;
+    case 'R': case 'r': return 2;
+  }
+  elis_error(S, "expected left, center or right");
+  return 0;
+}
+
+static elis_Object *f_text(elis_State *S, elis_Object *args) {
+  int x = elis_to_number(S, elis_next_arg(S, &args)) + camera.x;
+  int y = elis_to_number(S, elis_next_arg(S, &args)) + camera.y;
+  Image *font = to_userdata(S, elis_next_arg(S, &args), &image_handlers);
+  if (font == target.image) elis_error(S, "can't draw canvas on itself");
+  const char *str = elis_to_string(S, elis_next_arg(S, &args));
+  int wrap = elis_nil(S, args) ? 0 : elis_to_number(S, elis_next_arg(S, &args));
+  draw_text(font, x, y, str, wrap, to_align(S, elis_car(S, args)));
+  return elis_bool(S, false);
+}
+
+static elis_Object *f_measure(elis_State *S, elis_Object *args) {
+  Image *font = to_userdata(S, elis_next_arg(S, &args), &image_handlers);
+  const char *str = elis_to_string(S, elis_next_arg(S, &args));
+  int wrap = elis_nil(S, args) ? 0 : elis_to_number(S, elis_next_arg(S, &args));
+  Layout *l = layout(font, str, wrap, 0);
+  return elis_cons(S, elis_number(S, l->width), elis_number(S, l->height));
+}
+
+static elis_Object *f_line(elis_State *S, elis_Object *args) {
+  int c = elis_to_number(S, elis_next_arg(S, &args));
+  int x0 = elis_to_number(S, elis_next_arg(S, &args)) + camera.x;
+  int y0 = elis_to_number(S, elis_next_arg(S, &args)) + camera.y;
+  int x1 = elis_to_number(S, elis_next_arg(S, &args)) + camera.x;
+  int y1 = elis_to_number(S, elis_next_arg(S, &args)) + camera.y;
+  line(x0, y0, x1, y1, c % num_colors);
+  return elis_bool(S, false);
+}
+
+static elis_Object *f_circle(elis_State *S, elis_Object *args) {
+  int c = elis_to_number(S, elis_next_arg(S, &args));
+  int x = elis_to_number(S, elis_next_arg(S, &args)) + camera.x;
+  int y = elis_to_number(S, elis_next_arg(S, &args)) + camera.y;
+  int r = elis_to_number(S, elis_next_arg(S, &args));
+  ellipse(x, y, r, r, !elis_nil(S, elis_car(S, args)), c % num_colors);
+  return elis_bool(S, false);
+}
+
+static elis_Object *f_ellipse(elis_State *S, elis_Object *args) {
+  int c = elis_to_number(S, elis_next_arg(S, &args));
+  int x = elis_to_number(S, elis_next_arg(S, &args)) + camera.x;
+  int y = elis_to_number(S, elis_next_arg(S, &args)) + camera.y;
+  int rx = elis_to_number(S, elis_next_arg(S, &args));
+  int ry = elis_to_number(S, elis_next_arg(S, &args));
+  ellipse(x, y, rx, ry, !elis_nil(S, elis_car(S, args)), c % num_colors);
+  return elis_bool(S, false);
+}
+
+#define MAX_VERTICES 64
+
+static elis_Object *f_polygon(elis_State *S, elis_Object *args) {
+  elis_Number xs[MAX_VERTICES], ys[MAX_VERTICES];
+  int c = elis_to_number(S, elis_next_arg(S, &args)), n = 0;
+  /* vertices are given by list or (for triangle) by arguments */
+  elis_Object *lst = elis_type(S, elis_car(S, args)) == ELIS_NUMBER ? args : elis_next_arg(S, &args);
+  for (; !elis_nil(S, lst); ++n) {
+    if (n == MAX_VERTICES) elis_error(S, "too many vertices");
+    xs[n] = elis_to_number(S, elis_next_arg(S, &lst)) + camera.x;
+    ys[n] = elis_to_number(S, elis_next_arg(S, &lst)) + camera.y;
+  }
+  polygon(xs, ys, n, c % num_colors);
+  return elis_bool(S, false);
+}
+
+static elis_Object *f_clip(elis_State *S, elis_Object *args) {
+  elis_Object *res = elis_list(S, (elis_Object *[]) {
+    elis_number(S, clip.x0),
+    elis_number(S, clip.y0),
+    elis_number(S, clip.x1 - clip.x0),
+    elis_number(S, clip.y1 - clip.y0)
+  }, 4);
+  /* need to clip? */
+  if (!elis_nil(S, args)) {
+    /* start point */
+    clip.x0 = elis_to_number(S, elis_next_arg(S, &args));
+    clip.y0 = elis_to_number(S, elis_next_arg(S, &args));
+    /* width and height */
+    clip.x1 = elis_to_number(S, elis_next_arg(S, &args));
+    clip.y1 = elis_to_number(S, elis_next_arg(S, &args));
+    /* width and height positive? */
+    if (clip.x1 > 0 && clip.y1 > 0) {
+      /* clip rect */
+      clip.x1 += clip.x0;
+      clip.y1 += clip.y0;
+      clip.x0 = clip.x0 > 0 ? clip.x0 : 0;
+      clip.y0 = clip.y0 > 0 ? clip.y0 : 0;
+      clip.x1 = clip.x1 > target.rect.x1 ? target.rect.x1 : clip.x1;
+      clip.y1 = clip.y1 > target.rect.y1 ? target.rect.y1 : clip.y1;
+    } else {
+      /* zero rect */
+      clip.x1 = clip.x0;
+      clip.y1 = clip.y0;
+    }
+  }
+  return res;
+}
+
+static elis_Object *f_camera(elis_State *S, elis_Object *args) {
+  elis_Object *res = elis_cons(S, elis_number(S, camera.x), elis_number(S, camera.y));
+  if (!elis_nil(S, args)) {
+    elis_Object *obj = elis_next_arg(S, &args);
+    camera.x = floor(elis_to_number(S, elis_car(S, obj)));
+    camera.y = floor(elis_to_number(S, elis_cdr(S, obj)));
+  }
+  return res;
+}
+
+static elis_Object *f_width(elis_State *S, elis_Object *args) {
+  if (elis_nil(S, args)) return elis_number(S, width);
+  elis_Handlers *type = NULL;
+  void *udata = elis_to_userdata(S, elis_next_arg(S, &args), &type);
+  if (type == &image_handlers) return elis_number(S, ((Image *) udata)->surface->w);
+  if (type == &tilemap_handlers) return elis_number(S, ((Tilemap *) udata)->width);
+  elis_error(S, "expected image or map");
+  return NULL;
+}
+
+static elis_Object *f_height(elis_State *S, elis_Object *args) {
+  if (elis_nil(S, args)) return elis_number(S, height);
+  elis_Handlers *type = NULL;
+  void *udata = elis_to_userdata(S, elis_next_arg(S, &args), &type);
+  if (type == &image_handlers) return elis_number(S, ((Image *) udata)->surface->h);
+  if (type == &tilemap_handlers) return elis_number(S, ((Tilemap *) udata)->height);
+  elis_error(S, "expected image or map");
+  return NULL;
+}
+
+static elis_Object *f_canvas(elis_State *S, elis_Object *args) {
+  int w = elis_to_number(S, elis_next_arg(S, &args));
+  int h = elis_to_number(S, elis_next_arg(S, &args));
+  if (w <= 0 || h <= 0) elis_error(S, "canvas size should be > 0");
+  /* canvas is palette image drawn as single sprite */
+  Image *image = calloc(1, sizeof(*image));
+  image->surface = SDL_CreateRGBSurfaceWithFormat(0, w, h, 8, SDL_PIXELFORMAT_INDEX8);
+  if (!image->surface) elis_error(S, SDL_GetError());
+  image->key = elis_nil(S, args) ? -1 : elis_to_number(S, elis_next_arg(S, &args));
+  image->size = h;
+  image->dirty = true;
+  return elis_userdata(S, image, &image_handlers);
+}
+
+static elis_Object *f_target(elis_State *S, elis_Object *args) {
+  set_target(elis_nil(S, args) ? NULL : to_userdata(S, elis_next_arg(S, &args), &image_handlers));
+  return elis_bool(S, false);
+}
+
+/* binary map is header followed by raw tiles, so it can be mapped to memory */
+typedef struct { char magic[4]; int32_t width, height, bits; } MapHeader;
+
+static const char map_magic[4] = { 'T', 'M', 'A', 'P' };
+
+static Tilemap *new_tilemap(elis_State *S, int w, int h, int bits) {
+  if (w <= 0 || h <= 0) elis_error(S, "map size should be > 0");
+  if (bits != 8 && bits != 16 && bits != 32) elis_error(S, "tile bits should be 8, 16 or 32");
+  /* tiles are indexed by int, and their size in bytes should fit too */
+  if ((int64_t) w * h > INT32_MAX / 4) elis_error(S, "map is too big");
+  Tilemap *map = calloc(1, sizeof(*map));
+  map->width = w;
+  map->height = h;
+  map->bits = bits;
+  return map;
+}
+
+static bool parse_number(const char **str, double *num) {
+  /* no number objects are allocated for tiles, fractions are accepted as elis reader does */
+  char *end;
+  *num = strtod(*str, &end);
+  if (end == *str) return false;
+  *str = end;
+  return true;
+}
+
+static inline bool tile_fits(int64_t tile, int bits) {
+  return tile >= -((int64_t) 1 << (bits - 1)) && tile < (int64_t) 1 << (bits - 1);
+}
+
+/* `bits` is 0 to pick smallest of 16 and 32 bits that fits all tiles */
+static Tilemap *load_text_map(elis_State *S, FILE *fp, int bits) {
+  /* read whole file at once, so it should be seekable */
+  long len = fseek(fp, 0, SEEK_END) ? -1 : ftell(fp);
+  char *buf = len < 0 || fseek(fp, 0, SEEK_SET) ? NULL : malloc(len + 1);
+  if (!buf) {
+    fclose(fp);
+    elis_error(S, len < 0 ? "bad map format" : "out of memory");
+  }
+  buf[fread(buf, 1, len, fp)] = '\0';
+  fclose(fp);
+  const char *str = buf;
+  double w = 0, h = 0, tile;
+  if (!parse_number(&str, &w) || !parse_number(&str, &h)) elis_error(S, "bad map format");
+  if (!(fabs(w) < INT32_MAX && fabs(h) < INT32_MAX)) elis_error(S, "map is too big");
+  Tilemap *map = new_tilemap(S, w, h, bits ? bits : 16);
+  /* read tiles first to know their range */
+  int n = map->width * map->height, max_bits = 8;
+  int32_t *tiles = calloc(n, sizeof(*tiles));
+  if (!tiles) {
+    free(buf);
+    elis_error(S, "out of memory");
+  }
+  for (int i = 0; i < n && parse_number(&str, &tile); ++i) {
+    if (!(tile > INT32_MIN - 1.0 && tile < INT32_MAX + 1.0)) elis_error(S, "tile doesn't fit in 32 bits");
+    tiles[i] = tile;
+    while (!tile_fits(tiles[i], max_bits)) max_bits <<= 1;
+  }
+  free(buf);
+  if (!bits) {
+    map->bits = max_bits > 16 ? 32 : 16;
+  } else if (max_bits > bits) {
+    elis_error(S, "tile doesn't fit in map bits");
+  }
+  map->tiles = calloc(n, map->bits / 8);
+  for (int i = 0; i < n; ++i) set_tile(map, i, tiles[i]);
+  free(tiles);
+  return map;
+}
+
+static Tilemap *load_binary_map(elis_State *S, FILE *fp, const char *filename) {
+  MapHeader hdr;
+  if (fread(&hdr, sizeof(hdr), 1, fp) != 1) elis_error(S, "bad map format");
+  Tilemap *map = new_tilemap(S, hdr.width, hdr.height, hdr.bits);
+  size_t size = (size_t) hdr.width * hdr.height * hdr.bits / 8;
+#ifdef __unix__
+  /* map file privately, so changes of tiles aren't written back */
+  int fd = open(filename, O_RDONLY);
+  struct stat st;
+  if (fd >= 0 && !fstat(fd, &st) && (size_t) st.st_size >= sizeof(hdr) + size) {
+    void *mem = mmap(NULL, sizeof(hdr) + size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+    if (mem != MAP_FAILED) {
+      map->mapped = mem;
+      map->mapped_size = sizeof(hdr) + size;
+      map->tiles = (uint8_t *) mem + sizeof(hdr);
+    }
+  }
+  if (fd >= 0) close(fd);
+#else
+  (void) filename;
+#endif
+  /* or just read it */
+  if (!map->mapped) {
+    map->tiles = malloc(size);
+    if (fread(map->tiles, 1, size, fp) != size) elis_error(S, "bad map format");
+  }
+  fclose(fp);
+  return map;
+}
+
+static elis_Object *f_tilemap(elis_State *S, elis_Object *args) {
+  Tilemap *map;
+  /* load map from file or create blank map? */
+  if (elis_type(S, elis_car(S, args)) == ELIS_STRING) {
+    const char *filename = elis_to_string(S, elis_next_arg(S, &args));
+    int bits = elis_nil(S, args) ? 0 : elis_to_number(S, elis_next_arg(S, &args));
+    FILE *fp = fopen(filename, "rb");
+    if (!fp) elis_error(S, "failed to open map");
+    char magic[4];
+    bool binary = fread(magic, 4, 1, fp) == 1 && !memcmp(magic, map_magic, 4);
+    rewind(fp);
+    map = binary ? load_binary_map(S, fp, filename) : load_text_map(S, fp, bits);
+  } else {
+    int w = elis_to_number(S, elis_next_arg(S, &args));
+    int h = elis_to_number(S, elis_next_arg(S, &args));
+    map = new_tilemap(S, w, h, elis_nil(S, args) ? 16 : elis_to_number(S, elis_next_arg(S, &args)));
+    map->tiles = calloc(w * h, map->bits / 8);
+  }
+  return elis_userdata(S, map, &tilemap_handlers);
+}
+
+static elis_Object *f_save(elis_State *S, elis_Object *args) {
+  Tilemap *map = to_userdata(S, elis_next_arg(S, &args), &tilemap_handlers);
+  FILE *fp = fopen(elis_to_string(S, elis_next_arg(S, &args)), "wb");
+  if (!fp) elis_error(S, "failed to save map");
+  MapHeader hdr = { .width = map->width, .height = map->height, .bits = map->bits };
+  memcpy(hdr.magic, map_magic, sizeof(map_magic));
+  bool ok = fwrite(&hdr, sizeof(hdr), 1, fp) == 1
+         && fwrite(map->tiles, map->bits / 8, map->width * map->height, fp) == (size_t) (map->width * map->height);
+  fclose(fp);
+  return elis_bool(S, ok);
+}
+
+/* collision with solid tiles, coordinates are in pixels */
+static bool solid_tile(const Tilemap *map, int tx, int ty) {
+  if (tx < 0 || ty < 0 || tx >= map->width || ty >= map->height) return map->edge;
+  int tile = get_tile(map, tx + ty * map->width);
+  return tile >= 0 && tile < map->max_solid && map->solid[tile >> 3] & 1 << (tile & 7);
+}
+
+static bool solid_rect(const Tilemap *map, double x0, double y0, double x1, double y1) {
+  int tx1 = ceil(x1 / map->cell), ty1 = ceil(y1 / map->cell);
+  for (int ty = floor(y0 / map->cell); ty < ty1; ++ty) {
+    for (int tx = floor(x0 / map->cell); tx < tx1; ++tx) {
+      if (solid_tile(map, tx, ty)) return true;
+    }
+  }
+  return false;
+}
+
+static double sweep_axis(const Tilemap *map, double pos, double size, double d, double o0, double o1, bool vertical, int *contact) {
+  /* check tiles entered by leading edge, one column (or row) after another */
+  int s = map->cell, r0 = floor(o0 / s), r1 = ceil(o1 / s);
+  int c = d > 0 ? ceil((pos + size) / s) : floor(pos / s) - 1;
+  int end = d > 0 ? ceil((pos + size + d) / s) : floor((pos + d) / s) - 1, step = d > 0 ? 1 : -1;
+  for (; d != 0 && c != end; c += step) {
+    for (int r = r0; r < r1; ++r) {
+      if (vertical ? solid_tile(map, r, c) : solid_tile(map, c, r)) {
+        *contact = step;
+        return d > 0 ? c * s - size : (c + 1) * s;
+      }
+    }
+  }
+  *contact = 0;
+  return pos + d;
+}
+
+static Tilemap *to_solid_map(elis_State *S, elis_Object *obj) {
+  Tilemap *map = to_userdata(S, obj, &tilemap_handlers);
+  if (!map->cell) elis_error(S, "solid tiles of map aren't set");
+  return map;
+}
+
+#define MAX_SOLID 65536 /* solid tiles are kept in bit table, so they are limited */
+
+static elis_Object *f_solid(elis_State *S, elis_Object *args) {
+  Tilemap *map = to_userdata(S, elis_next_arg(S, &args), &tilemap_handlers);
+  int cell = elis_to_number(S, elis_next_arg(S, &args));
+  if (cell <= 0) elis_error(S, "tile size should be > 0");
+  /* solid tiles are given by list of numbers and `(from . to)` ranges */
+  elis_Object *lst = elis_next_arg(S, &args);
+  map->cell = cell;
+  map->edge = !elis_nil(S, elis_car(S, args));
+  map->max_solid = 0;
+  /* table of solid tiles is sized by largest of them, which can't exceed tile range of map */
+  int max_solid = 0;
+  for (elis_Object *it = lst; !elis_nil(S, it); ) {
+    elis_Object *range = elis_next_arg(S, &it);
+    bool pair = elis_type(S, range) == ELIS_PAIR;
+    elis_Number from = elis_to_number(S, pair ? elis_car(S, range) : range);
+    elis_Number to = elis_to_number(S, pair ? elis_cdr(S, range) : range);
+    if (!(to >= 0 && to < (int64_t) 1 << (map->bits - 1) && to < MAX_SOLID)) elis_error(S, "solid tile out of tile range");
+    if (from > to) elis_error(S, "solid tiles range should be from lower to higher");
+    if (to >= max_solid) max_solid = (int) to + 1;
+  }
+  uint8_t *solid = realloc(map->solid, max_solid / 8 + 1);
+  if (!solid) elis_error(S, "out of memory");
+  memset(solid, 0, max_solid / 8 + 1);
+  map->solid = solid;
+  map->max_solid = max_solid;
+  while (!elis_nil(S, lst)) {
+    elis_Object *range = elis_next_arg(S, &lst);
+    bool pair = elis_type(S, range) == ELIS_PAIR;
+    int from = elis_to_number(S, pair ? elis_car(S, range) : range);
+    int to = elis_to_number(S, pair ? elis_cdr(S, range) : range);
+    for (int tile = from > 0 ? from : 0; tile <= to; ++tile) map->solid[tile >> 3] |= 1 << (tile & 7);
+  }
+  return elis_bool(S, false);
+}
+
+static elis_Object *f_collide(elis_State *S, elis_Object *args) {
+  Tilemap *map = to_solid_map(S, elis_next_arg(S, &args));
+  elis_Number x = elis_to_number(S, elis_next_arg(S, &args));
+  elis_Number y = elis_to_number(S, elis_next_arg(S, &args));
+  /* point or rect */
+  if (elis_nil(S, args)) return elis_bool(S, solid_tile(map, floor(x / map->cell), floor(y / map->cell)));
+  elis_Number w = elis_to_number(S, elis_next_arg(S, &args));
+  elis_Number h = elis_to_number(S, elis_next_arg(S, &args));
+  return elis_bool(S, solid_rect(map, x, y, x + w, y + h));
+}
+
+static elis_Object *f_sweep(elis_State *S, elis_Object *args) {
+  Tilemap *map = to_solid_map(S, elis_next_arg(S, &args));
+  elis_Number x = elis_to_number(S, elis_next_arg(S, &args));
+  elis_Number y = elis_to_number(S, elis_next_arg(S, &args));
+  elis_Number w = elis_to_number(S, elis_next_arg(S, &args));
+  elis_Number h = elis_to_number(S, elis_next_arg(S, &args));
+  elis_Number dx = elis_to_number(S, elis_next_arg(S, &args));
+  elis_Number dy = elis_to_number(S, elis_next_arg(S, &args));
+  /* move along x, then along y from new position */
+  int cx, cy;
+  x = sweep_axis(map, x, w, dx, y, y + h, false, &cx);
+  y = sweep_axis(map, y, h, dy, x, x + w, true, &cy);
+  return elis_list(S, (elis_Object *[]) {
+    elis_number(S, x), elis_number(S, y), elis_number(S, cx), elis_number(S, cy)
+  }, 4);
+}
+
+static elis_Object *f_raycast(elis_State *S, elis_Object *args) {
+  Tilemap *map = to_solid_map(S, elis_next_arg(S, &args));
+  elis_Number x = elis_to_number(S, elis_next_arg(S, &args));
+  elis_Number y = elis_to_number(S, elis_next_arg(S, &args));
+  elis_Number dx = elis_to_number(S, elis_next_arg(S, &args)) - x;
+  elis_Number dy = elis_to_number(S, elis_next_arg(S, &args)) - y;
+  /* walk through tiles crossed by segment, `t` is fraction of segment passed */
+  int s = map->cell, tx = floor(x / s), ty = floor(y / s), step_x = dx > 0 ? 1 : -1, step_y = dy > 0 ? 1 : -1;
+  double t = 0, delta_x = dx ? s / fabs(dx) : HUGE_VAL, delta_y = dy ? s / fabs(dy) : HUGE_VAL;
+  double next_x = dx > 0 ? ((tx + 1) * s - x) / dx : dx < 0 ? (tx * s - x) / dx : HUGE_VAL;
+  double next_y = dy > 0 ? ((ty + 1) * s - y) / dy : dy < 0 ? (ty * s - y) / dy : HUGE_VAL;
+  while (!solid_tile(map, tx, ty)) {
+    if (next_x < next_y) {
+      t = next_x, next_x += delta_x, tx += step_x;
+    } else {
+      t = next_y, next_y += delta_y, ty += step_y;
+    }
+    if (t > 1) return elis_bool(S, false);
+  }
+  return elis_list(S, (elis_Object *[]) {
+    elis_number(S, x + dx * t), elis_number(S, y + dy * t), elis_number(S, tx), elis_number(S, ty)
+  }, 4);
+}
+
+/* layers are composited by single call, front to back culling tiles hidden by opaque ones */
+#define MAX_LAYERS 16
+#define COVER_SIZE 8 /* size of coverage cell in pixels */
+
+static struct { Image *image; Tilemap *map; elis_Number px, py; elis_Object *image_obj, *map_obj; } layers[MAX_LAYERS];
+static uint8_t *cover_cells; /* cells of target fully covered by opaque tiles */
+static int cover_width;
+
+static inline int floor_div(int a, int b) {
+  return a >= 0 ? a / b : -((b - a - 1) / b);
+}
+
+static bool opaque(Image *image, int s) {
+  int h = image->surface->h, size = image->size;
+  const Row *row = image->rows + (s * size % h + h) % h;
+  for (int i = 0; i < size; ++i) {
+    if (row[i].kind != ROW_SOLID) return false;
+  }
+  return true;
+}
+
+static bool covered(Rect r) {
+  for (int y = r.y0 / COVER_SIZE; y <= (r.y1 - 1) / COVER_SIZE; ++y) {
+    for (int x = r.x0 / COVER_SIZE; x <= (r.x1 - 1) / COVER_SIZE; ++x) {
+      if (!cover_cells[x + y * cover_width]) return false;
+    }
+  }
+  return true;
+}
+
+static void cover(Rect r) {
+  /* cells cut by clip are covered if their visible part is */
+  int x0 = r.x0 == clip.x0 ? r.x0 / COVER_SIZE : (r.x0 + COVER_SIZE - 1) / COVER_SIZE;
+  int y0 = r.y0 == clip.y0 ? r.y0 / COVER_SIZE : (r.y0 + COVER_SIZE - 1) / COVER_SIZE;
+  int x1 = r.x1 == clip.x1 ? (r.x1 + COVER_SIZE - 1) / COVER_SIZE : r.x1 / COVER_SIZE;
+  int y1 = r.y1 == clip.y1 ? (r.y1 + COVER_SIZE - 1) / COVER_SIZE : r.y1 / COVER_SIZE;
+  for (int y = y0; y < y1; ++y) {
+    if (x0 < x1) memset(cover_cells + x0 + y * cover_width, 1, x1 - x0);
+  }
+}
+
+static void composite(int z0, int z1) {
+  static Sprite *visible;
+  static size_t cap;
+  size_t len = 0;
+  /* reset coverage of render target */
+  cover_width = (target.rect.x1 + COVER_SIZE - 1) / COVER_SIZE;
+  int cells = cover_width * ((target.rect.y1 + COVER_SIZE - 1) / COVER_SIZE);
+  cover_cells = realloc(cover_cells, cells);
+  memset(cover_cells, 0, cells);
+  /* collect visible tiles from top layer to bottom */
+  for (int z = z1; z >= z0; --z) {
+    Image *image = layers[z].image;
+    if (!image) continue;
+    if (image->dirty) {
+      encode_spans(image);
+      image->dirty = false;
+    }
+    Tilemap *map = layers[z].map;
+    int x = layers[z].px * camera.x, y = layers[z].py * camera.y, w = image->surface->w, h = image->size;
+    /* canvas is single tile */
+    int tx0 = 0, ty0 = 0, tx1 = 1, ty1 = 1;
+    if (map) {
+      tx0 = floor_div(clip.x0 - x, w), tx1 = floor_div(clip.x1 - x - 1, w) + 1;
+      ty0 = floor_div(clip.y0 - y, h), ty1 = floor_div(clip.y1 - y - 1, h) + 1;
+      tx0 = tx0 > 0 ? tx0 : 0, tx1 = tx1 < map->width ? tx1 : map->width;
+      ty0 = ty0 > 0 ? ty0 : 0, ty1 = ty1 < map->height ? ty1 : map->height;
+    }
+    for (int ty = ty0; ty < ty1; ++ty) {
+      for (int tx = tx0; tx < tx1; ++tx) {
+        int px = x + tx * w, py = y + ty * h, s = map ? get_tile(map, tx + ty * map->width) : 0;
+        Rect r = intersect((Rect) { px, py, px + w, py + h }, clip);
+        if (EMPTY(r) || covered(r)) continue;
+        if (opaque(image, s)) cover(r);
+        if (len == cap) {
+          cap = cap ? cap << 1 : 256;
+          visible = realloc(visible, cap * sizeof(*visible));
+        }
+        visible[len++] = (Sprite) { px, py, s, z };
+      }
+    }
+  }
+  /* and draw them from bottom to top */
+  while (len-- > 0) draw(layers[visible[len].order].image, visible[len].x, visible[len].y, visible[len].sprite, 0);
+}
+
+static elis_Object *f_layer(elis_State *S, elis_Object *args) {
+  int z = elis_to_number(S, elis_next_arg(S, &args));
+  if (z < 0 || z >= MAX_LAYERS) elis_error(S, "layer index out of range");
+  layers[z].image = NULL;
+  /* layer is removed if only index is passed */
+  if (!elis_nil(S, args)) {
+    layers[z].image_obj = elis_next_arg(S, &args);
+    layers[z].image = to_userdata(S, layers[z].image_obj, &image_handlers);
+    layers[z].map_obj = NULL;
+    layers[z].map = NULL;
+    if (elis_type(S, elis_car(S, args)) == ELIS_USERDATA) {
+      layers[z].map_obj = elis_next_arg(S, &args);
+      layers[z].map = to_userdata(S, layers[z].map_obj, &tilemap_handlers);
+    }
+    layers[z].px = elis_nil(S, args) ? 1 : elis_to_number(S, elis_next_arg(S, &args));
+    layers[z].py = elis_nil(S, args) ? layers[z].px : elis_to_number(S, elis_next_arg(S, &args));
+  }
+  return elis_bool(S, false);
+}
+
+/* images and maps of layers may be referenced only by layers, so they are marked on every collection */
+static void mark_layers(void) {
+  for (int z = 0; z < MAX_LAYERS; ++z) {
+    if (!layers[z].image) continue;
+    elis_mark(S, layers[z].image_obj);
+    if (layers[z].map_obj) elis_mark(S, layers[z].map_obj);
+  }
+}
+
+static elis_Object *f_layers(elis_State *S, elis_Object *args) {
+  int z0 = elis_nil(S, args) ? 0 : elis_to_number(S, elis_next_arg(S, &args));
+  int z1 = elis_nil(S, args) ? MAX_LAYERS - 1 : elis_to_number(S, elis_next_arg(S, &args));
+  z0 = z0 > 0 ? z0 : 0, z1 = z1 < MAX_LAYERS - 1 ? z1 : MAX_LAYERS - 1;
+  for (int z = z0; z <= z1; ++z) {
+    if (layers[z].image && layers[z].image == target.image) elis_error(S, "can't draw canvas on itself");
+  }
+  composite(z0, z1);
+  return elis_bool(S, false);
+}
+
+/*
+ * API: palette
+ */
+
+static void set_color(int pal, int idx, SDL_Color col) {
+  palettes[pal][idx] = col;
+  colors[pal][idx] = SDL_MapRGB(format, col.r, col.g, col.b);
+}
+
+static inline int color_index(elis_State *S, elis_Object *obj) {
+  int idx = elis_to_number(S, obj);
+  if (idx < 0 || idx >= num_colors) elis_error(S, "color index out of palette");
+  return idx;
+}
+
+static elis_Object *f_palette(elis_State *S, elis_Object *args) {
+  elis_Object *res = elis_number(S, cur_palette);
+  if (!elis_nil(S, args)) {
+    int pal = elis_to_number(S, elis_next_arg(S, &args));
+    if (pal < 0 || pal >= MAX_PALETTES) elis_error(S, "palette number out of range");
+    cur_palette = pal;
+  }
+  return res;
+}
+
+static elis_Object *f_color(elis_State *S, elis_Object *args) {
+  int idx = color_index(S, elis_next_arg(S, &args));
+  SDL_Color col = palettes[cur_palette][idx];
+  elis_Object *res = elis_list(S, (elis_Object *[]) {
+    elis_number(S, col.r),
+    elis_number(S, col.g),
+    elis_number(S, col.b)
+  }, 3);
+  if (!elis_nil(S, args)) {
+    col.r = elis_to_number(S, elis_next_arg(S, &args));
+    col.g = elis_to_number(S, elis_next_arg(S, &args));
+    col.b = elis_to_number(S, elis_next_arg(S, &args));
+    set_color(cur_palette, idx, col);
+  }
+  return res;
+}
+
+static elis_Object *f_remap(elis_State *S, elis_Object *args) {
+  int idx = color_index(S, elis_next_arg(S, &args));
+  set_color(cur_palette, idx, base_colors[color_index(S, elis_next_arg(S, &args))]);
+  return elis_bool(S, false);
+}
+
+static elis_Object *f_cycle(elis_State *S, elis_Object *args) {
+  int idx = color_index(S, elis_next_arg(S, &args));
+  int len = elis_to_number(S, elis_next_arg(S, &args));
+  int shift = elis_to_number(S, elis_next_arg(S, &args));
+  if (len > num_colors - idx) len = num_colors - idx;
+  if (len <= 0) return elis_bool(S, false);
+  /* rotate range of entries */
+  SDL_Color tmp[256];
+  memcpy(tmp, palettes[cur_palette] + idx, len * sizeof(*tmp));
+  for (int i = 0; i < len; ++i) set_color(cur_palette, idx + ((i + shift) % len + len) % len, tmp[i]);
+  return elis_bool(S, false);
+}
+
+static elis_Object *f_blend(elis_State *S, elis_Object *args) {
+  elis_Number r = elis_to_number(S, elis_next_arg(S, &args));
+  elis_Number g = elis_to_number(S, elis_next_arg(S, &args));
+  elis_Number b = elis_to_number(S, elis_next_arg(S, &args));
+  elis_Number t = elis_to_number(S, elis_next_arg(S, &args));
+  int idx = 0, len = num_colors;
+  if (!elis_nil(S, args)) {
+    idx = color_index(S, elis_next_arg(S, &args));
+    len = elis_to_number(S, elis_next_arg(S, &args));
+    if (len > num_colors - idx) len = num_colors - idx;
+  }
+  /* mix base colors with given color */
+  t = t < 0 ? 0 : t > 1 ? 1 : t;
+  for (int i = idx; i < idx + len; ++i) {
+    SDL_Color col = base_colors[i];
+    col.r += (r - col.r) * t;
+    col.g += (g - col.g) * t;
+    col.b += (b - col.b) * t;
+    set_color(cur_palette, i, col);
+  }
+  return elis_bool(S, false);
+}
+
+static elis_Object *f_scanlines(elis_State *S, elis_Object *args) {
+  int pal = elis_to_number(S, elis_next_arg(S, &args)), y = 0, h = height;
+  if (pal < 0 || pal >= MAX_PALETTES) elis_error(S, "palette number out of range");
+  if (!elis_nil(S, args)) {
+    y = elis_to_number(S, elis_next_arg(S, &args));
+    h = elis_nil(S, args) ? 1 : elis_to_number(S, elis_next_arg(S, &args));
+  }
+  /* set palette of screen rows */
+  if (y < 0) h += y, y = 0;
+  if (y + h > height) h = height - y;
+  if (h > 0) memset(scanlines + y, pal, h);
+  return elis_bool(S, false);
+}
+
+/*
+ * API: spatial hash
+ */
+
+static inline Bucket *grid_bucket(Grid *grid, int cx, int cy) {
+  return &grid->buckets[((unsigned) cx * 73856093u ^ (unsigned) cy * 19349663u) % GRID_BUCKETS];
+}
+
+static void grid_link(Grid *grid, int id, bool insert) {
+  const Entity *e = &grid->entities[id];
+  for (int cy = e->cy0; cy <= e->cy1; ++cy) {
+    for (int cx = e->cx0; cx <= e->cx1; ++cx) {
+      Bucket *b = grid_bucket(grid, cx, cy);
+      if (insert) {
+        if (b->count == b->cap) {
+          b->cap = b->cap ? b->cap << 1 : 8;
+          b->entries = realloc(b->entries, b->cap * sizeof(*b->entries));
+        }
+        b->entries[b->count++] = (Entry) { id, cx, cy };
+        continue;
+      }
+      /* unordered removal */
+      for (int i = 0; i < b->count; ++i) {
+        if (b->entries[i].entity == id && b->entries[i].cx == cx && b->entries[i].cy == cy) {
+          b->entries[i] = b->entries[--b->count];
+          break;
+        }
+      }
+    }
+  }
+}
+
+static void grid_place(Grid *grid, int id, double x, double y, double w, double h) {
+  Entity *e = &grid->entities[id];
+  int cx0 = floor(x / grid->cell), cy0 = floor(y / grid->cell);
+  int cx1 = floor((x + w) / grid->cell), cy1 = floor((y + h) / grid->cell);
+  e->x0 = x, e->y0 = y, e->x1 = x + w, e->y1 = y + h;
+  /* entity moved within same cells? */
+  if (e->cx0 == cx0 && e->cy0 == cy0 && e->cx1 == cx1 && e->cy1 == cy1) return;
+  grid_link(grid, id, false);
+  e->cx0 = cx0, e->cy0 = cy0, e->cx1 = cx1, e->cy1 = cy1;
+  grid_link(grid, id, true);
+}
+
+static int to_entity(elis_State *S, Grid *grid, elis_Object *obj) {
+  int id = elis_to_number(S, obj);
+  if (id < 0 || id >= grid->num_entities || !grid->entities[id].obj) elis_error(S, "bad entity id");
+  return id;
+}
+
+static elis_Object *f_grid(elis_State *S, elis_Object *args) {
+  elis_Number cell = elis_to_number(S, elis_next_arg(S, &args));
+  if (cell <= 0) elis_error(S, "cell size should be > 0");
+  Grid *grid = calloc(1, sizeof(*grid));
+  grid->cell = cell;
+  grid->free_entity = -1;
+  return elis_userdata(S, grid, &grid_handlers);
+}
+
+static elis_Object *f_insert(elis_State *S, elis_Object *args) {
+  Grid *grid = to_userdata(S, elis_next_arg(S, &args), &grid_handlers);
+  elis_Object *obj = elis_next_arg(S, &args);
+  elis_Number x = elis_to_number(S, elis_next_arg(S, &args));
+  elis_Number y = elis_to_number(S, elis_next_arg(S, &args));
+  elis_Number w = elis_to_number(S, elis_next_arg(S, &args));
+  elis_Number h = elis_to_number(S, elis_next_arg(S, &args));
+  /* reuse id of removed entity */
+  int id = grid->free_entity;
+  if (id >= 0) {
+    grid->free_entity = grid->entities[id].next;
+  } else {
+    if (grid->num_entities == grid->max_entities) {
+      grid->max_entities = grid->max_entities ? grid->max_entities << 1 : 64;
+      grid->entities = realloc(grid->entities, grid->max_entities * sizeof(*grid->entities));
+    }
+    id = grid->num_entities++;
+  }
+  /* empty cell range, so entity is linked by placing */
+  grid->entities[id] = (Entity) { obj, 0, 0, 0, 0, 0, 0, -1, -1, grid->stamp, -1 };
+  grid_place(grid, id, x, y, w, h);
+  return elis_number(S, id);
+}
+
+static elis_Object *f_move(elis_State *S, elis_Object *args) {
+  Grid *grid = to_userdata(S, elis_next_arg(S, &args), &grid_handlers);
+  int id = to_entity(S, grid, elis_next_arg(S, &args));
+  elis_Number x = elis_to_number(S, elis_next_arg(S, &args));
+  elis_Number y = elis_to_number(S, elis_next_arg(S, &args));
+  elis_Number w = elis_to_number(S, elis_next_arg(S, &args));
+  elis_Number h = elis_to_number(S, elis_next_arg(S, &args));
+  grid_place(grid, id, x, y, w, h);
+  return elis_bool(S, false);
+}
+
+static elis_Object *f_remove(elis_State *S, elis_Object *args) {
+  Grid *grid = to_userdata(S, elis_next_arg(S, &args), &grid_handlers);
+  int id = to_entity(S, grid, elis_next_arg(S, &args));
+  grid_link(grid, id, false);
+  grid->entities[id].obj = NULL;
+  grid->entities[id].next = grid->free_entity;
+  grid->free_entity = id;
+  return elis_bool(S, false);
+}
+
+static elis_Object *f_query(elis_State *S, elis_Object *args) {
+  Grid *grid = to_userdata(S, elis_next_arg(S, &args), &grid_handlers);
+  elis_Number x = elis_to_number(S, elis_next_arg(S, &args));
+  elis_Number y = elis_to_number(S, elis_next_arg(S, &args));
+  elis_Number w = elis_to_number(S, elis_next_arg(S, &args)), h = 0, r = w;
+  /* rect or circle */
+  bool circle = elis_nil(S, args);
+  if (circle) {
+    x -= r, y -= r, w = h = 2 * r;
+  } else {
+    h = elis_to_number(S, elis_next_arg(S, &args));
+  }
+  int cx0 = floor(x / grid->cell), cy0 = floor(y / grid->cell);
+  int cx1 = floor((x + w) / grid->cell), cy1 = floor((y + h) / grid->cell);
+  elis_Object *lst = elis_bool(S, false);
+  int gc = elis_save_gc(S), stamp = ++grid->stamp;
+  for (int cy = cy0; cy <= cy1; ++cy) {
+    for (int cx = cx0; cx <= cx1; ++cx) {
+      Bucket *b = grid_bucket(grid, cx, cy);
+      for (int i = 0; i < b->count; ++i) {
+        Entity *e = &grid->entities[b->entries[i].entity];
+        /* entity overlapping several cells is checked once */
+        if (b->entries[i].cx != cx || b->entries[i].cy != cy || e->stamp == stamp) continue;
+        e->stamp = stamp;
+        if (e->x0 >= x + w || e->x1 <= x || e->y0 >= y + h || e->y1 <= y) continue;
+        if (circle) {
+          /* distance from center to nearest point of entity */
+          double dx = fmax(e->x0 - (x + r), fmax(0, x + r - e->x1));
+          double dy = fmax(e->y0 - (y + r), fmax(0, y + r - e->y1));
+          if (dx * dx + dy * dy > r * r) continue;
+        }
+        lst = elis_cons(S, e->obj, lst);
+        elis_restore_gc(S, gc);
+        elis_push_gc(S, lst);
+      }
+    }
+  }
+  return lst;
+}
+
+static elis_Object *f_pairs(elis_State *S, elis_Object *args) {
+  Grid *grid = to_userdata(S, elis_next_arg(S, &args), &grid_handlers);
+  elis_Object *lst = elis_bool(S, false);
+  int gc = elis_save_gc(S);
+  for (int k = 0; k < GRID_BUCKETS; ++k) {
+    const Bucket *b = &grid->buckets[k];
+    for (int i = 0; i < b->count; ++i) {
+      const Entry *p = &b->entries[i];
+      const Entity *a = &grid->entities[p->entity];
+      for (int j = i + 1; j < b->count; ++j) {
+        const Entry *q = &b->entries[j];
+        const Entity *e = &grid->entities[q->entity];
+        if (p->cx != q->cx || p->cy != q->cy) continue;
+        if (a->x0 >= e->x1 || e->x0 >= a->x1 || a->y0 >= e->y1 || e->y0 >= a->y1) continue;
+        /* pair is reported only by first cell shared by both entities */
+        if (p->cx != (a->cx0 > e->cx0 ? a->cx0 : e->cx0) || p->cy != (a->cy0 > e->cy0 ? a->cy0 : e->cy0)) continue;
+        lst = elis_cons(S, elis_cons(S, a->obj, e->obj), lst);
+        elis_restore_gc(S, gc);
+        elis_push_gc(S, lst);
+      }
+    }
+  }
+  return lst;
+}
+
+/*
+ * API: particles
+ */
+
+static elis_Object *f_emitter(elis_State *S, elis_Object *args) {
+  int max = elis_to_number(S, elis_next_arg(S, &args));
+  if (max <= 0) elis_error(S, "number of particles should be > 0");
+  Emitter *em = calloc(1, sizeof(*em));
+  em->max = max;
+  em->gx = elis_nil(S, args) ? 0 : elis_to_number(S, elis_next_arg(S, &args));
+  em->gy = elis_nil(S, args) ? 0 : elis_to_number(S, elis_next_arg(S, &args));
+  em->drag = elis_nil(S, args) ? 1 : elis_to_number(S, elis_next_arg(S, &args));
+  /* particles may collide with solid tiles of map */
+  if (!elis_nil(S, args)) {
+    em->map_obj = elis_next_arg(S, &args);
+    em->map = to_solid_map(S, em->map_obj);
+    em->bounce = elis_nil(S, args) ? 0 : elis_to_number(S, elis_next_arg(S, &args));
+  }
+  /* all fields are allocated by single block */
+  em->x = malloc(max * (4 * sizeof(float) + 2 * sizeof(int)));
+  em->y = em->x + max, em->vx = em->y + max, em->vy = em->vx + max;
+  em->life = (int *) (em->vy + max), em->c = em->life + max;
+  return elis_userdata(S, em, &emitter_handlers);
+}
+
+static elis_Object *f_emit(elis_State *S, elis_Object *args) {
+  Emitter *em = to_userdata(S, elis_next_arg(S, &args), &emitter_handlers);
+  /* new particles are dropped when emitter is full */
+  if (em->count == em->max) return elis_bool(S, false);
+  int i = em->count++;
+  em->x[i] = elis_to_number(S, elis_next_arg(S, &args));
+  em->y[i] = elis_to_number(S, elis_next_arg(S, &args));
+  em->vx[i] = elis_to_number(S, elis_next_arg(S, &args));
+  em->vy[i] = elis_to_number(S, elis_next_arg(S, &args));
+  em->life[i] = elis_to_number(S, elis_next_arg(S, &args));
+  em->c[i] = elis_to_number(S, elis_next_arg(S, &args));
+  return elis_bool(S, true);
+}
+
+static void collide_particles(Emitter *em) {
+  /* particle entering solid tile bounces back from it on that axis */
+  const Tilemap *map = em->map;
+  for (int i = 0; i < em->count; ++i) {
+    float px = em->x[i] - em->vx[i], py = em->y[i] - em->vy[i];
+    if (solid_tile(map, floor(em->x[i] / map->cell), floor(py / map->cell))) {
+      em->x[i] = px;
+      em->vx[i] *= -em->bounce;
+    }
+    if (solid_tile(map, floor(em->x[i] / map->cell), floor(em->y[i] / map->cell))) {
+      em->y[i] = py;
+      em->vy[i] *= -em->bounce;
+    }
+  }
+}
+
+static elis_Object *f_simulate(elis_State *S, elis_Object *args) {
+  Emitter *em = to_userdata(S, elis_next_arg(S, &args), &emitter_handlers);
+  int n = em->count;
+  float gx = em->gx, gy = em->gy, drag = em->drag;
+  float *restrict x = em->x, *restrict y = em->y, *restrict vx = em->vx, *restrict vy = em->vy;
+  int *restrict life = em->life;
+  /* independent loops are vectorized by compiler */
+  for (int i = 0; i < n; ++i) {
+    vx[i] = (vx[i] + gx) * drag;
+    vy[i] = (vy[i] + gy) * drag;
+  }
+  for (int i = 0; i < n; ++i) {
+    x[i] += vx[i];
+    y[i] += vy[i];
+  }
+  for (int i = 0; i < n; ++i) --life[i];
+  if (em->map) collide_particles(em);
+  /* replace dead particles by last ones */
+  for (int i = 0; i < em->count; ) {
+    if (em->life[i] > 0) {
+      ++i;
+      continue;
+    }
+    int j = --em->count;
+    x[i] = x[j], y[i] = y[j], vx[i] = vx[j], vy[i] = vy[j], life[i] = life[j], em->c[i] = em->c[j];
+  }
+  return elis_number(S, em->count);
+}
+
+static elis_Object *f_plot(elis_State *S, elis_Object *args) {
+  /* particles are squares of their colors */
+  Emitter *em = to_userdata(S, elis_next_arg(S, &args), &emitter_handlers);
+  int size = elis_nil(S, args) ? 1 : elis_to_number(S, elis_next_arg(S, &args));
+  if (num_points + em->count > max_points) {
+    max_points = (num_points + em->count) * 2;
+    points = realloc(points, max_points * sizeof(*points));
+  }
+  Rect bounds = { INT32_MAX, INT32_MAX, INT32_MIN, INT32_MIN };
+  for (int i = 0; i < em->count; ++i) {
+    Point p = { em->x[i] + camera.x, em->y[i] + camera.y, em->c[i] % num_colors };
+    points[num_points + i] = p;
+    bounds.x0 = p.x < bounds.x0 ? p.x : bounds.x0, bounds.x1 = p.x + size > bounds.x1 ? p.x + size : bounds.x1;
+    bounds.y0 = p.y < bounds.y0 ? p.y : bounds.y0, bounds.y1 = p.y + size > bounds.y1 ? p.y + size : bounds.y1;
+  }
+  Command cmd = { raster_points, intersect(bounds, clip), NULL, num_points, em->count, size, 0 };
+  num_points += em->count;
+  submit(&cmd);
+  /* points are kept only for deferred command */
+  if (!deferred) num_points = 0;
+  return elis_bool(S, false);
+}
+
+/*
+ * Mixer
+ */
+
+static Sound *new_sound(void) {
+  Sound *sound = calloc(1, sizeof(*sound));
+  sound->voices.first = sound->voices.last = -1;
+  sound->limit = MAX_VOICES;
+  return sound;
+}
+
+static void link_voice(VoiceList *list, int i, int k) {
+  voices[i].prev[k] = list->last;
+  voices[i].next[k] = -1;
+  if (list->last >= 0) voices[list->last].next[k] = i; else list->first = i;
+  list->last = i;
+}
+
+static void unlink_voice(VoiceList *list, int i, int k) {
+  Voice *v = &voices[i];
+  if (v->prev[k] >= 0) voices[v->prev[k]].next[k] = v->next[k]; else list->first = v->next[k];
+  if (v->next[k] >= 0) voices[v->next[k]].prev[k] = v->prev[k]; else list->last = v->prev[k];
+}
+
+static void release_voice(int i) {
+  Voice *v = &voices[i];
+  unlink_voice(&active[v->priority], i, BY_PRIORITY);
+  unlink_voice(&v->sound->voices, i, BY_SOUND);
+  --v->sound->count;
+  v->sound = NULL;
+  v->next[BY_PRIORITY] = free_voice;
+  free_voice = i;
+}
+
+/* returns frame of mixer clock to start timed voice at */
+static uint64_t schedule(const AudioCommand *cmd) {
+  /* command is applied at start of buffer, which should be ahead of frame of its game time */
+  int64_t now = anchor_frame + (int64_t) llround((cmd->now - anchor_time) * audio.freq);
+  if (!anchored || now < (int64_t) mixer.clock || now > (int64_t) (mixer.clock + audio.freq / MAX_DRIFT)) {
+    /* start new mapping with latency of one buffer */
+    anchored = true;
+    anchor_time = cmd->now;
+    anchor_frame = now = mixer.clock + audio.samples;
+  }
+  return now + llround(fmax(cmd->delay, 0) * audio.freq);
+}
+
+static Mixer get_mixer(void) {
+  for (;;) {
+    int seq = SDL_AtomicGet(&mixer_seq);
+    Mixer copy = mixer;
+    if (!(seq & 1) && seq == SDL_AtomicGet(&mixer_seq)) return copy;
+  }
+}
+
+/* returns -1 if there is no voice to steal */
+static int alloc_voice(Sound *sound, bool music) {
+  int priority = music ? MAX_PRIORITY : sound->priority;
+  /* too many voices of sound -- steal oldest of them */
+  if (sound->count >= sound->limit) {
+    if (sound->voices.first < 0) return -1;
+    release_voice(sound->voices.first);
+  }
+  /* no free voices -- steal oldest of lowest priority */
+  for (int p = 0; free_voice < 0 && p <= priority; ++p) {
+    if (active[p].first >= 0) release_voice(active[p].first);
+  }
+  if (free_voice < 0) return -1;
+  int i = free_voice;
+  free_voice = voices[i].next[BY_PRIORITY];
+  voices[i].sound = sound;
+  voices[i].priority = priority;
+  link_voice(&active[priority], i, BY_PRIORITY);
+  link_voice(&sound->voices, i, BY_SOUND);
+  ++sound->count;
+  return i;
+}
+
+static inline void mix_samples(int32_t *acc, const int16_t *src, int n, const int *gain) {
+  int i = 0;
+#ifdef __SSE2__
+  /* full 32 bit products of 8 samples at once */
+  const __m128i g = _mm_set_epi16(gain[1], gain[0], gain[1], gain[0], gain[1], gain[0], gain[1], gain[0]);
+  for (; i + 8 <= n; i += 8) {
+    __m128i s = _mm_loadu_si128((const __m128i *) (src + i));
+    __m128i lo = _mm_mullo_epi16(s, g), hi = _mm_mulhi_epi16(s, g);
+    __m128i a = _mm_loadu_si128((const __m128i *) (acc + i));
+    __m128i b = _mm_loadu_si128((const __m128i *) (acc + i + 4));
+    _mm_storeu_si128((__m128i *) (acc + i), _mm_add_epi32(a, _mm_srai_epi32(_mm_unpacklo_epi16(lo, hi), 14)));
+    _mm_storeu_si128((__m128i *) (acc + i + 4), _mm_add_epi32(b, _mm_srai_epi32(_mm_unpackhi_epi16(lo, hi), 14)));
+  }
+#endif
+  for (; i < n; ++i) acc[i] += src[i] * gain[i & 1] >> 14;
+}
+
+/* mixes `length` stereo frames of `src` into `acc` until `frames` are filled, returns number of mixed frames */
+static int mix_voice(Voice *v, int32_t *acc, int frames, const int16_t *src, uint32_t length) {
+  uint64_t pos = v->position;
+  int n = 0;
+  if (v->step == 1 << 16) {
+    if ((pos >> 16) < length) n = SDL_min((uint32_t) frames, length - (uint32_t) (pos >> 16));
+    mix_samples(acc, src + (pos >> 16) * 2, n * 2, v->gain);
+    pos += (uint64_t) n << 16;
   } else {
-    Tilemap *map = to_userdata(S, args, &tilemap_handlers);
-    for (int i = 0; i < map->width * map->height; ++i) map->tiles[i] = col;
+    /* resample with linear interpolation, next frame is needed */
+    for (; n < frames && (pos >> 16) + 1 < length; ++n, pos += v->step) {
+      const int16_t *s = src + (pos >> 16) * 2;
+      int t = (pos & 0xffff) >> 1;
+      acc[n * 2]     += (s[0] + ((s[2] - s[0]) * t >> 15)) * v->gain[0] >> 14;
+      acc[n * 2 + 1] += (s[1] + ((s[3] - s[1]) * t >> 15)) * v->gain[1] >> 14;
+    }
   }
-  return elis_bool(S, false);
+  v->position = pos;
+  return n;
 }
 
-static elis_Object *f_fill(elis_State *S, elis_Object *args) {
-  int c = elis_to_number(S, elis_next_arg(S, &args));
-  int x = elis_to_number(S, elis_next_arg(S, &args));
-  int y = elis_to_number(S, elis_next_arg(S, &args));
-  switch (elis_type(S, elis_car(S, args))) {
-    case ELIS_NUMBER: {
-      int w = elis_to_number(S, elis_next_arg(S, &args));
-      int h = elis_to_number(S, elis_next_arg(S, &args));
-      c %= num_colors, x += camera.x, y += camera.y;
-      /* do horizontal clip */
-      if (x + w >= clip.x1) w = clip.x1 - x;
-      if (x < clip.x0) w += x - clip.x0, x = clip.x0;
-      /* early exit if completely clipped */
-      if (w > 0) {
-        /* do vertical clip */
-        if (y + h >= clip.y1) h = clip.y1 - y;
-        if (y < clip.y0) h += y - clip.y0, y = clip.y0;
-        /* fill scanlines */
-        for (uint8_t *row = screen + x + y * width; h-- > 0; row += width) memset(row, c, w);
-      }
-      break;
-    }
-    case ELIS_USERDATA: {
-      Tilemap *map = to_userdata(S, elis_next_arg(S, &args), &tilemap_handlers);
-      if (x >= 0 && x < map->width && y >= 0 && y < map->height) map->tiles[x + y * map->width] = c;
-      break;
-    }
-    default: elis_error(S, "expected number or map");
+/* returns true if sound is over */
+static bool mix_sound(Voice *v, int32_t *acc, int frames) {
+  const int16_t *src = (const int16_t *) v->sound->buffer;
+  uint32_t length = v->sound->length / 4;
+  for (int done = 0, n; done < frames; done += n) {
+    n = mix_voice(v, acc + done * 2, frames - done, src, length);
+    if (done + n == frames) break;
+    /* voice isn't looping (or sound is too short to loop)? */
+    if (!v->music || (!n && v->position < 1 << 16)) return true;
+    v->position &= 0xffff;
   }
-  return elis_bool(S, false);
+  return false;
 }
 
-static elis_Object *f_peek(elis_State *S, elis_Object *args) {
-  int x = elis_to_number(S, elis_next_arg(S, &args));
-  int y = elis_to_number(S, elis_next_arg(S, &args));
-  if (!elis_nil(S, args)) {
-    Tilemap *map = to_userdata(S, elis_next_arg(S, &args), &tilemap_handlers);
-    return elis_number(S, x < 0 || x >= map->width || y < 0 || y >= map->height
-                          ? 0
-                          : map->tiles[x + y * width]);
+static void write_samples(int16_t *dst, const int32_t *acc, int n) {
+  int i = 0;
+#ifdef __SSE2__
+  /* saturated pack of 8 samples at once */
+  for (; i + 8 <= n; i += 8) {
+    __m128i a = _mm_loadu_si128((const __m128i *) (acc + i));
+    __m128i b = _mm_loadu_si128((const __m128i *) (acc + i + 4));
+    _mm_storeu_si128((__m128i *) (dst + i), _mm_packs_epi32(a, b));
   }
-  return elis_number(S, x < 0 || x >= width || y < 0 || y >= height ? 0 : screen[x + y * width]);
+#endif
+  for (; i < n; ++i) dst[i] = acc[i] > INT16_MAX ? INT16_MAX : acc[i] < INT16_MIN ? INT16_MIN : acc[i];
 }
 
-static void draw(SDL_Surface *surface, int x, int y, int s) {
-  int w = surface->w, h = w, sx = 0, sy = (s * w % surface->h + surface->h) % surface->h;
-  /* do horizontal clip */
-  if (x + w >= clip.x1) w = clip.x1 - x;
-  if (x < clip.x0) x -= clip.x0, sx -= x, w += x, x = clip.x0;
-  if (w <= 0) return;
-  /* do vertical clip */
-  if (y + h >= clip.y1) h = clip.y1 - y;
-  if (y < clip.y0) y -= clip.y0, sy -= y, h += y, y = clip.y0;
-  /* copy scanlines from sprite to virtual screen */
-  uint8_t *dst = (uint8_t *) screen + x + y * width;
-  uint8_t *src = (uint8_t *) surface->pixels + sx + sy * surface->pitch;
-  uint8_t key = (uintptr_t) surface->userdata;
-  while (h-- > 0) {
-    for (int i = 0; i < w; ++i) {
-      if (src[i] != key) dst[i] = src[i];
-    }
-    dst += width, src += surface->pitch;
+/*
+ * Sound synthesis
+ */
+
+/* replaces buffer of sound with one in device format */
+static void convert_sound(Sound *sound, const SDL_AudioSpec *spec) {
+  SDL_AudioCVT cvt;
+  int ret = SDL_BuildAudioCVT(&cvt, spec->format, spec->channels, spec->freq, audio.format, audio.channels, audio.freq);
+  if (ret == -1) elis_error(S, "can't convert audio");
+  /* convert audio, if needed */
+  if (ret == 1) {
+    /* allocate memory for conversion */
+    cvt.buf = malloc(sound->length * cvt.len_mult);
+    cvt.len = sound->length;
+    memcpy(cvt.buf, sound->buffer, cvt.len);
+    /* convert and replace buffer in `sound` */
+    if (SDL_ConvertAudio(&cvt)) elis_error(S, SDL_GetError());
+    free(sound->buffer);
+    sound->buffer = cvt.buf;
+    sound->length = cvt.len_cvt;
   }
 }
 
-static elis_Object *f_draw(elis_State *S, elis_Object *args) {
-  int x = elis_to_number(S, elis_next_arg(S, &args)) + camera.x;
-  int y = elis_to_number(S, elis_next_arg(S, &args)) + camera.y;
-  SDL_Surface *surface = to_userdata(S, elis_next_arg(S, &args), &image_handlers);
-  args = elis_next_arg(S, &args);
-  switch (elis_type(S, args)) {
-    case ELIS_NUMBER:
-      draw(surface, x, y, elis_to_number(S, args));
-      break;
-    case ELIS_STRING:
-      for (const char *str = elis_to_string(S, args); *str; ++str, x += surface->w) {
-        if (*str >= ' ' && *str <= '~') draw(surface, x, y, *str - 32);
-      }
-      break;
-    case ELIS_USERDATA: {
-      Tilemap *map = to_userdata(S, args, &tilemap_handlers);
-      for (int ty = 0, py = y; ty < map->height; ++ty, py += surface->w) {
-        for (int tx = 0, px = x; tx < map->width; ++tx, px += surface->w) {
-          draw(surface, px, py, map->tiles[tx + ty * map->width]);
+/* sfxr parameters, values are clamped to their range from `min` to 1 */
+enum {
+  SYN_WAVE, SYN_FREQ, SYN_LIMIT, SYN_SLIDE, SYN_DELTA_SLIDE, SYN_DUTY, SYN_DUTY_SLIDE,
+  SYN_VIBRATO, SYN_VIBRATO_SPEED, SYN_ATTACK, SYN_SUSTAIN, SYN_PUNCH, SYN_DECAY,
+  SYN_LPF, SYN_LPF_SLIDE, SYN_RESONANCE, SYN_HPF, SYN_HPF_SLIDE, SYN_PHASER, SYN_PHASER_SLIDE,
+  SYN_REPEAT, SYN_ARP_SPEED, SYN_ARP_MOD, NUM_SYNTH
+};
+
+static const struct { const char *name; double value, min; } synth_params[NUM_SYNTH] = {
+  [SYN_WAVE]          = { "wave",          0,    0 },
+  [SYN_FREQ]          = { "freq",          0.3,  0 },
+  [SYN_LIMIT]         = { "limit",         0,    0 },
+  [SYN_SLIDE]         = { "slide",         0,   -1 },
+  [SYN_DELTA_SLIDE]   = { "delta-slide",   0,   -1 },
+  [SYN_DUTY]          = { "duty",          0,    0 },
+  [SYN_DUTY_SLIDE]    = { "duty-slide",    0,   -1 },
+  [SYN_VIBRATO]       = { "vibrato",       0,    0 },
+  [SYN_VIBRATO_SPEED] = { "vibrato-speed", 0,    0 },
+  [SYN_ATTACK]        = { "attack",        0,    0 },
+  [SYN_SUSTAIN]       = { "sustain",       0.3,  0 },
+  [SYN_PUNCH]         = { "punch",         0,    0 },
+  [SYN_DECAY]         = { "decay",         0.4,  0 },
+  [SYN_LPF]           = { "lpf",           1,    0 },
+  [SYN_LPF_SLIDE]     = { "lpf-slide",     0,   -1 },
+  [SYN_RESONANCE]     = { "resonance",     0,    0 },
+  [SYN_HPF]           = { "hpf",           0,    0 },
+  [SYN_HPF_SLIDE]     = { "hpf-slide",     0,   -1 },
+  [SYN_PHASER]        = { "phaser",        0,   -1 },
+  [SYN_PHASER_SLIDE]  = { "phaser-slide",  0,   -1 },
+  [SYN_REPEAT]        = { "repeat",        0,    0 },
+  [SYN_ARP_SPEED]     = { "arp-speed",     0,    0 },
+  [SYN_ARP_MOD]       = { "arp-mod",       0,   -1 }
+};
+
+enum { WAVE_SQUARE, WAVE_SAW, WAVE_SINE, WAVE_NOISE };
+
+static const char *wave_names[] = { "square", "saw", "sine", "noise", NULL };
+
+/* rendered sounds are cached by hash of parameters and device format */
+#define SYNTH_CACHE   "sfx-cache"
+#define SYNTH_VERSION 1
+#define SYNTH_FREQ    44100
+
+typedef struct {
+  const double *p; uint32_t noise_seed;
+  double period, max_period, slide, delta_slide, duty, duty_slide, arp_mod;
+  double lpf, lpf_delta, lpf_damp, lpf_pos, lpf_vel, lpf_slide, hpf, hpf_pos, hpf_slide;
+  double vib_phase, vib_speed, vib_amp, env_vol, phase_offset, phase_slide;
+  int phase, env_stage, env_time, env_length[3], arp_time, arp_limit, rep_time, rep_limit, ipp;
+  double phaser[1024], noise[32];
+} Synth;
+
+static double synth_noise(Synth *sy) {
+  /* xorshift, seeded by parameters, so same sound is rendered every time */
+  sy->noise_seed ^= sy->noise_seed << 13;
+  sy->noise_seed ^= sy->noise_seed >> 17;
+  sy->noise_seed ^= sy->noise_seed << 5;
+  return sy->noise_seed / 2147483648.0 - 1;
+}
+
+static void reset_synth(Synth *sy, bool restart) {
+  const double *p = sy->p;
+  if (!restart) sy->phase = 0;
+  sy->period = 100 / (p[SYN_FREQ] * p[SYN_FREQ] + 0.001);
+  sy->max_period = 100 / (p[SYN_LIMIT] * p[SYN_LIMIT] + 0.001);
+  sy->slide = 1 - pow(p[SYN_SLIDE], 3) * 0.01;
+  sy->delta_slide = -pow(p[SYN_DELTA_SLIDE], 3) * 0.000001;
+  sy->duty = 0.5 - p[SYN_DUTY] * 0.5;
+  sy->duty_slide = -p[SYN_DUTY_SLIDE] * 0.00005;
+  sy->arp_mod = p[SYN_ARP_MOD] >= 0 ? 1 - pow(p[SYN_ARP_MOD], 2) * 0.9 : 1 + pow(p[SYN_ARP_MOD], 2) * 10;
+  sy->arp_time = 0;
+  sy->arp_limit = p[SYN_ARP_SPEED] == 1 ? 0 : pow(1 - p[SYN_ARP_SPEED], 2) * 20000 + 32;
+  if (restart) return;
+  /* filters */
+  sy->lpf_pos = sy->lpf_vel = 0;
+  sy->lpf = pow(p[SYN_LPF], 3) * 0.1;
+  sy->lpf_delta = 1 + p[SYN_LPF_SLIDE] * 0.0001;
+  sy->lpf_damp = fmin(5 / (1 + pow(p[SYN_RESONANCE], 2) * 20) * (0.01 + sy->lpf), 0.8);
+  sy->hpf_pos = 0;
+  sy->hpf = pow(p[SYN_HPF], 2) * 0.1;
+  sy->hpf_slide = 1 + p[SYN_HPF_SLIDE] * 0.0003;
+  /* vibrato */
+  sy->vib_phase = 0;
+  sy->vib_speed = pow(p[SYN_VIBRATO_SPEED], 2) * 0.01;
+  sy->vib_amp = p[SYN_VIBRATO] * 0.5;
+  /* envelope */
+  sy->env_vol = 0;
+  sy->env_stage = sy->env_time = 0;
+  sy->env_length[0] = p[SYN_ATTACK] * p[SYN_ATTACK] * 100000;
+  sy->env_length[1] = p[SYN_SUSTAIN] * p[SYN_SUSTAIN] * 100000;
+  sy->env_length[2] = p[SYN_DECAY] * p[SYN_DECAY] * 100000;
+  /* phaser */
+  sy->phase_offset = copysign(pow(p[SYN_PHASER], 2) * 1020, p[SYN_PHASER]);
+  sy->phase_slide = copysign(pow(p[SYN_PHASER_SLIDE], 2), p[SYN_PHASER_SLIDE]);
+  sy->ipp = 0;
+  memset(sy->phaser, 0, sizeof(sy->phaser));
+  for (int i = 0; i < 32; ++i) sy->noise[i] = synth_noise(sy);
+  sy->rep_time = 0;
+  sy->rep_limit = p[SYN_REPEAT] == 0 ? 0 : pow(1 - p[SYN_REPEAT], 2) * 20000 + 32;
+}
+
+/* renders mono 16 bit sound at SYNTH_FREQ, returns number of samples */
+static uint32_t synthesize(const double *p, uint32_t seed, int16_t **out) {
+  Synth sy = { .p = p, .noise_seed = seed | 1 };
+  reset_synth(&sy, false);
+  uint32_t n = 0, max = sy.env_length[0] + sy.env_length[1] + sy.env_length[2] + 3;
+  int16_t *buf = malloc(max * sizeof(*buf));
+  for (bool playing = true; playing && n < max; ++n) {
+    if (sy.rep_limit && ++sy.rep_time >= sy.rep_limit) {
+      sy.rep_time = 0;
+      reset_synth(&sy, true);
+    }
+    /* frequency envelopes and arpeggio */
+    if (sy.arp_limit && ++sy.arp_time >= sy.arp_limit) {
+      sy.arp_limit = 0;
+      sy.period *= sy.arp_mod;
+    }
+    sy.slide += sy.delta_slide;
+    sy.period *= sy.slide;
+    if (sy.period > sy.max_period) {
+      sy.period = sy.max_period;
+      if (p[SYN_LIMIT] > 0) playing = false;
+    }
+    double period = sy.period;
+    if (sy.vib_amp > 0) {
+      sy.vib_phase += sy.vib_speed;
+      period *= 1 + sin(sy.vib_phase) * sy.vib_amp;
+    }
+    int iperiod = period < 8 ? 8 : period;
+    sy.duty = fmin(fmax(sy.duty + sy.duty_slide, 0), 0.5);
+    /* volume envelope: attack, sustain with punch, decay */
+    if (++sy.env_time > sy.env_length[sy.env_stage]) {
+      sy.env_time = 0;
+      if (++sy.env_stage == 3) break;
+    }
+    double t = sy.env_length[sy.env_stage] ? (double) sy.env_time / sy.env_length[sy.env_stage] : 0;
+    sy.env_vol = sy.env_stage == 0 ? t : sy.env_stage == 1 ? 1 + (1 - t) * 2 * p[SYN_PUNCH] : 1 - t;
+    /* phaser and high-pass filter slides */
+    sy.phase_offset += sy.phase_slide;
+    int iphase = fabs(sy.phase_offset);
+    if (iphase > 1023) iphase = 1023;
+    sy.hpf = fmin(fmax(sy.hpf * sy.hpf_slide, 0.00001), 0.1);
+    /* 8x supersampling */
+    double sum = 0;
+    for (int k = 0; k < 8; ++k) {
+      if (++sy.phase >= iperiod) {
+        sy.phase %= iperiod;
+        if (p[SYN_WAVE] == WAVE_NOISE) {
+          for (int i = 0; i < 32; ++i) sy.noise[i] = synth_noise(&sy);
         }
       }
-      break;
+      double fp = (double) sy.phase / iperiod, sample = 0;
+      switch ((int) p[SYN_WAVE]) {
+        case WAVE_SQUARE: sample = fp < sy.duty ? 0.5 : -0.5; break;
+        case WAVE_SAW:    sample = 1 - fp * 2; break;
+        case WAVE_SINE:   sample = sin(fp * 2 * 3.14159265358979323846); break;
+        case WAVE_NOISE:  sample = sy.noise[sy.phase * 32 / iperiod]; break;
+      }
+      /* low-pass filter */
+      double prev = sy.lpf_pos;
+      sy.lpf = fmin(fmax(sy.lpf * sy.lpf_delta, 0), 0.1);
+      if (p[SYN_LPF] != 1) {
+        sy.lpf_vel += (sample - sy.lpf_pos) * sy.lpf;
+        sy.lpf_vel -= sy.lpf_vel * sy.lpf_damp;
+      } else {
+        sy.lpf_pos = sample;
+        sy.lpf_vel = 0;
+      }
+      sy.lpf_pos += sy.lpf_vel;
+      /* high-pass filter */
+      sy.hpf_pos += sy.lpf_pos - prev;
+      sy.hpf_pos -= sy.hpf_pos * sy.hpf;
+      sample = sy.hpf_pos;
+      /* phaser */
+      sy.phaser[sy.ipp & 1023] = sample;
+      sample += sy.phaser[(sy.ipp - iphase + 1024) & 1023];
+      sy.ipp = (sy.ipp + 1) & 1023;
+      sum += sample * sy.env_vol;
     }
-    default: elis_error(S, "expected number, string or map");
+    /* average of supersamples at half of full scale, which leaves room for punch */
+    buf[n] = fmin(fmax(sum / 16, -1), 1) * INT16_MAX;
   }
-  return elis_bool(S, false);
+  *out = buf;
+  return n;
 }
 
-static elis_Object *f_clip(elis_State *S, elis_Object *args) {
-  elis_Object *res = elis_list(S, (elis_Object *[]) {
-    elis_number(S, clip.x0),
-    elis_number(S, clip.y0),
-    elis_number(S, clip.x1 - clip.x0),
-    elis_number(S, clip.y1 - clip.y0)
-  }, 4);
-  /* need to clip? */
-  if (!elis_nil(S, args)) {
-    /* start point */
-    clip.x0 = elis_to_number(S, elis_next_arg(S, &args));
-    clip.y0 = elis_to_number(S, elis_next_arg(S, &args));
-    /* width and height */
-    clip.x1 = elis_to_number(S, elis_next_arg(S, &args));
-    clip.y1 = elis_to_number(S, elis_next_arg(S, &args));
-    /* width and height positive? */
-    if (clip.x1 > 0 && clip.y1 > 0) {
-      /* clip rect */
-      clip.x1 += clip.x0;
-      clip.y1 += clip.y0;
-      clip.x0 = clip.x0 > 0 ? clip.x0 : 0;
-      clip.y0 = clip.y0 > 0 ? clip.y0 : 0;
-      clip.x1 = clip.x1 > width  ? width  : clip.x1;
-      clip.y1 = clip.y1 > height ? height : clip.y1;
+static Sound *load_synth(elis_Object *args) {
+  double p[NUM_SYNTH];
+  for (int i = 0; i < NUM_SYNTH; ++i) p[i] = synth_params[i].value;
+  /* read `name value` pairs */
+  while (!elis_nil(S, args)) {
+    const char *name = elis_to_string(S, elis_next_arg(S, &args));
+    elis_Object *value = elis_next_arg(S, &args);
+    int i = 0;
+    while (i < NUM_SYNTH && strcmp(synth_params[i].name, name)) ++i;
+    if (i == NUM_SYNTH) elis_error(S, "unknown synth parameter");
+    if (i == SYN_WAVE) {
+      const char *wave = elis_to_string(S, value);
+      int w = 0;
+      while (wave_names[w] && strcmp(wave_names[w], wave)) ++w;
+      if (!wave_names[w]) elis_error(S, "unknown wave");
+      p[i] = w;
     } else {
-      /* zero rect */
-      clip.x1 = clip.x0;
-      clip.y1 = clip.y0;
+      p[i] = fmin(fmax(elis_to_number(S, value), synth_params[i].min), 1);
     }
   }
-  return res;
+  /* hash parameters and device format */
+  int key[] = { SYNTH_VERSION, audio.freq, audio.format, audio.channels };
+  uint64_t hash = 14695981039346656037u;
+  for (size_t i = 0; i < sizeof(p); ++i) hash = (hash ^ ((uint8_t *) p)[i]) * 1099511628211u;
+  for (size_t i = 0; i < sizeof(key); ++i) hash = (hash ^ ((uint8_t *) key)[i]) * 1099511628211u;
+  char path[64];
+  snprintf(path, sizeof(path), SYNTH_CACHE "/%016llx.raw", (unsigned long long) hash);
+  Sound *sound = new_sound();
+  /* load cached sound */
+  FILE *fp = fopen(path, "rb");
+  if (fp) {
+    fseek(fp, 0, SEEK_END);
+    long size = ftell(fp);
+    rewind(fp);
+    sound->buffer = malloc(size > 0 ? size : 1);
+    sound->length = size > 0 && fread(sound->buffer, 1, size, fp) == (size_t) size ? size : 0;
+    fclose(fp);
+    if (sound->length) return sound;
+    free(sound->buffer);
+  }
+  /* or render and convert it */
+  int16_t *samples;
+  sound->length = synthesize(p, hash, &samples) * sizeof(*samples);
+  sound->buffer = (uint8_t *) samples;
+  SDL_AudioSpec spec = { .freq = SYNTH_FREQ, .format = AUDIO_S16SYS, .channels = 1 };
+  convert_sound(sound, &spec);
+  /* and save it, if cache directory can be made */
+#ifdef __unix__
+  mkdir(SYNTH_CACHE, 0755);
+#endif
+  /* partly written file would be loaded as valid sound, so it's renamed only when complete */
+  char tmp[72];
+  snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+  fp = fopen(tmp, "wb");
+  if (fp) {
+    bool ok = fwrite(sound->buffer, 1, sound->length, fp) == sound->length;
+    ok = !fclose(fp) && ok;
+    if (!ok || rename(tmp, path)) remove(tmp);
+  }
+  return sound;
 }
 
-static elis_Object *f_camera(elis_State *S, elis_Object *args) {
-  elis_Object *res = elis_cons(S, elis_number(S, camera.x), elis_number(S, camera.y));
-  if (!elis_nil(S, args)) {
-    elis_Object *obj = elis_next_arg(S, &args);
-    camera.x = floor(elis_to_number(S, elis_car(S, obj)));
-    camera.y = floor(elis_to_number(S, elis_cdr(S, obj)));
+/*
+ * Audio streams
+ */
+
+static Stream *open_stream(const char *filename) {
+  SDL_RWops *file = SDL_RWFromFile(filename, "rb");
+  if (!file) elis_error(S, SDL_GetError());
+  char id[4];
+  if (SDL_RWread(file, id, 1, 4) != 4 || memcmp(id, "RIFF", 4)) elis_error(S, "unsupported WAV file");
+  SDL_ReadLE32(file);
+  if (SDL_RWread(file, id, 1, 4) != 4 || memcmp(id, "WAVE", 4)) elis_error(S, "unsupported WAV file");
+  /* find format and data chunks */
+  SDL_AudioFormat format = 0;
+  int channels = 0, freq = 0;
+  while (SDL_RWread(file, id, 1, 4) == 4) {
+    uint32_t size = SDL_ReadLE32(file);
+    Sint64 next = SDL_RWtell(file) + size + (size & 1);
+    if (!memcmp(id, "fmt ", 4)) {
+      int tag = SDL_ReadLE16(file);
+      channels = SDL_ReadLE16(file);
+      freq = SDL_ReadLE32(file);
+      /* skip byte rate and block align */
+      SDL_ReadLE32(file);
+      SDL_ReadLE16(file);
+      int bits = SDL_ReadLE16(file);
+      format = tag == 1 && bits == 8  ? AUDIO_U8
+             : tag == 1 && bits == 16 ? AUDIO_S16LSB
+             : tag == 1 && bits == 32 ? AUDIO_S32LSB
+             : tag == 3 && bits == 32 ? AUDIO_F32LSB : 0;
+    } else if (!memcmp(id, "data", 4) && format) {
+      Stream *st = calloc(1, sizeof(*st));
+      st->cvt = SDL_NewAudioStream(format, channels, freq, audio.format, audio.channels, audio.freq);
+      if (!st->cvt) elis_error(S, SDL_GetError());
+      st->file = file;
+      st->offset = SDL_RWtell(file);
+      st->size = size;
+      /* streamer will fill ring from start, music is expected */
+      st->fresh = true;
+      SDL_AtomicSet(&st->loop, true);
+      SDL_AtomicSet(&st->restart, true);
+      st->next = streams;
+      streams = st;
+      return st;
+    }
+    SDL_RWseek(file, next, RW_SEEK_SET);
   }
-  return res;
+  elis_error(S, "unsupported WAV file");
+  return NULL;
 }
 
-static elis_Object *f_width(elis_State *S, elis_Object *args) {
-  if (elis_nil(S, args)) return elis_number(S, width);
-  elis_Handlers *type = NULL;
-  void *udata = elis_to_userdata(S, elis_next_arg(S, &args), &type);
-  if (type == &image_handlers) return elis_number(S, ((SDL_Surface *) udata)->w);
-  if (type == &tilemap_handlers) return elis_number(S, ((Tilemap *) udata)->width);
-  elis_error(S, "expected image or map");
-  return NULL;
+/* called by streamer thread, converts file chunks until ring is full */
+static void fill_stream(Stream *st) {
+  if (SDL_AtomicGet(&st->restart)) {
+    /* mixer doesn't read ring until restart is done */
+    SDL_RWseek(st->file, st->offset, RW_SEEK_SET);
+    SDL_AudioStreamClear(st->cvt);
+    st->remain = st->size;
+    st->flushed = false;
+    SDL_AtomicSet(&st->eof, false);
+    SDL_AtomicSet(&st->write, SDL_AtomicGet(&st->read));
+    SDL_AtomicSet(&st->restart, false);
+  }
+  uint8_t chunk[STREAM_CHUNK];
+  uint32_t write = SDL_AtomicGet(&st->write);
+  while (!SDL_AtomicGet(&st->eof) && STREAM_SIZE - (write - (uint32_t) SDL_AtomicGet(&st->read)) >= STREAM_CHUNK) {
+    /* take converted samples */
+    uint32_t offset = write & (STREAM_SIZE - 1);
+    int n = SDL_AudioStreamGet(st->cvt, st->ring + offset, SDL_min(STREAM_CHUNK, STREAM_SIZE - offset));
+    if (n > 0) {
+      write += n;
+      SDL_AtomicSet(&st->write, write);
+      continue;
+    }
+    /* converter is empty, feed it from file */
+    if (!st->remain) {
+      if (SDL_AtomicGet(&st->loop)) {
+        SDL_RWseek(st->file, st->offset, RW_SEEK_SET);
+        st->remain = st->size;
+      } else if (!st->flushed) {
+        SDL_AudioStreamFlush(st->cvt);
+        st->flushed = true;
+        continue;
+      } else {
+        SDL_AtomicSet(&st->eof, true);
+        break;
+      }
+    }
+    size_t len = SDL_RWread(st->file, chunk, 1, SDL_min(st->remain, STREAM_CHUNK));
+    if (!len) {
+      /* file is broken, end stream */
+      SDL_AtomicSet(&st->eof, true);
+      break;
+    }
+    st->remain -= len;
+    SDL_AudioStreamPut(st->cvt, chunk, len);
+  }
 }
 
-static elis_Object *f_height(elis_State *S, elis_Object *args) {
-  if (elis_nil(S, args)) return elis_number(S, height);
-  elis_Handlers *type = NULL;
-  void *udata = elis_to_userdata(S, elis_next_arg(S, &args), &type);
-  if (type == &image_handlers) return elis_number(S, ((SDL_Surface *) udata)->h);
-  if (type == &tilemap_handlers) return elis_number(S, ((Tilemap *) udata)->height);
-  elis_error(S, "expected image or map");
-  return NULL;
+static int stream_thread(void *udata) {
+  (void) udata;
+  while (SDL_AtomicGet(&streaming)) {
+    SDL_LockMutex(stream_lock);
+    for (Stream *st = streams; st; st = st->next) fill_stream(st);
+    SDL_UnlockMutex(stream_lock);
+    SDL_SemWaitTimeout(stream_wake, 10);
+  }
+  return 0;
 }
 
-static int parse_int(FILE *fp) {
-  elis_Object *obj = elis_read_fp(S, fp);
-  if (!obj) elis_error(S, "bad map format");
-  return elis_to_number(S, obj);
+/* called by mixer, stream has only one voice */
+static void start_stream(Stream *st, bool loop) {
+  /* ring already holds beginning of stream? */
+  if (st->fresh && SDL_AtomicGet(&st->loop) == loop) return;
+  SDL_AtomicSet(&st->loop, loop);
+  SDL_AtomicSet(&st->restart, true);
+  st->fresh = true;
+  SDL_SemPost(stream_wake);
 }
 
-static elis_Object *f_tilemap(elis_State *S, elis_Object *args) {
-  FILE *fp = NULL;
-  int w, h;
-  /* load map from file or create blank map? */
-  if (elis_nil(S, elis_cdr(S, args))) {
-    fp = fopen(elis_to_string(S, elis_next_arg(S, &args)), "r");
-    if (!fp) elis_error(S, "failed to open map");
-    w = parse_int(fp), h = parse_int(fp);
-  } else {
-    w = elis_to_number(S, elis_next_arg(S, &args)), h = elis_to_number(S, elis_next_arg(S, &args));
-  }
-  /* allocate map */
-  Tilemap *map = calloc(1, sizeof(*map) + w * h * sizeof(int));
-  map->width = w;
-  map->height = h;
-  /* load map contents from file */
-  if (fp) {
-    for (int i = 0, gc = elis_save_gc(S); (args = elis_read_fp(S, fp)) && i < w * h; ++i) {
-      map->tiles[i] = elis_to_number(S, args);
-      elis_restore_gc(S, gc);
-    }
-    fclose(fp);
-  }
-  return elis_userdata(S, map, &tilemap_handlers);
+/* called by mixer, voice position holds only fraction of frame, returns true if stream is over */
+static bool mix_stream(Voice *v, int32_t *acc, int frames) {
+  Stream *st = v->sound->stream;
+  if (SDL_AtomicGet(&st->restart)) return false;
+  /* check end before taking samples, all of them are written by then */
+  bool eof = SDL_AtomicGet(&st->eof);
+  uint32_t read = SDL_AtomicGet(&st->read), avail = (uint32_t) SDL_AtomicGet(&st->write) - read;
+  /* gather needed frames from ring, with one more for interpolation */
+  uint32_t need = (uint32_t) ((v->position + (uint64_t) frames * v->step) >> 16) + 1;
+  uint32_t len = SDL_min(need * 4, avail), offset = read & (STREAM_SIZE - 1), first = SDL_min(len, STREAM_SIZE - offset);
+  memcpy(scratch, st->ring + offset, first);
+  memcpy((uint8_t *) scratch + first, st->ring, len - first);
+  int n = mix_voice(v, acc, frames, scratch, len / 4);
+  if (n < frames && !eof) ++starved;
+  /* release used frames */
+  SDL_AtomicSet(&st->read, read + (uint32_t) (v->position >> 16) * 4);
+  v->position &= 0xffff;
+  st->fresh = false;
+  SDL_SemPost(stream_wake);
+  return eof && n < frames;
 }
 
 /*
  * API: audio
  */
 
-enum { SOUND = 0x0, MUSIC = 0x1, PAUSE = 0x2, ANY = MUSIC | PAUSE | SOUND };
+static void run_command(const AudioCommand *cmd) {
+  Sound *sound = cmd->sound;
+  if (cmd->op == CMD_LIMIT) {
+    /* stream has only one voice */
+    sound->limit = sound->stream ? 1 : cmd->limit;
+    sound->priority = cmd->priority;
+    while (sound->count > sound->limit) release_voice(sound->voices.first);
+    return;
+  }
+  /* walk voices of sound, or all voices */
+  bool found = false;
+  for (int p = 0; p <= MAX_PRIORITY; ++p) {
+    VoiceList *list = sound ? &sound->voices : &active[p];
+    int k = sound ? BY_SOUND : BY_PRIORITY;
+    for (int i = list->first, next; i >= 0; i = next) {
+      next = voices[i].next[k];
+      switch (cmd->op) {
+        case CMD_RESUME: voices[i].paused = false; found = true; break;
+        case CMD_PAUSE:  voices[i].paused = true; break;
+        case CMD_STOP:   release_voice(i); break;
+      }
+    }
+    if (sound) break;
+  }
+  /* start new voice, if there is free one or one to steal */
+  if (cmd->op == CMD_PLAY || (cmd->op == CMD_RESUME && cmd->music && !found)) {
+    int i = alloc_voice(sound, cmd->music);
+    if (i < 0) return;
+    if (sound->stream) start_stream(sound->stream, cmd->music);
+    Voice *v = &voices[i];
+    v->position = 0;
+    v->delay = cmd->timed ? schedule(cmd) - mixer.clock : 0;
+    v->step = cmd->step;
+    v->gain[0] = cmd->gain[0];
+    v->gain[1] = cmd->gain[1];
+    v->music = cmd->music;
+    v->paused = false;
+  }
+}
 
-#define GET_TAG(s)    ((uintptr_t) (s) & ANY)
-#define SET_TAG(s, T) ((Sound *) ((uintptr_t) (s) | T))
-#define UNTAG(s, T)   ((Sound *) ((uintptr_t) (s) & ~(uintptr_t) (T)))
+/* called by mixer only, or by game thread while device is locked */
+static void drain_commands(void) {
+  for (int head = SDL_AtomicGet(&queue_head); head != SDL_AtomicGet(&queue_tail); ) {
+    run_command(&audio_queue[head]);
+    head = (head + 1) % AUDIO_QUEUE_SIZE;
+    SDL_AtomicSet(&queue_head, head);
+  }
+}
 
-#define ANY_SOUND        ((Sound *) ~(uintptr_t) ANY)
-#define SAME_SOUND(a, b) (((uintptr_t) a & ~(uintptr_t) b) <= ANY)
+static void push_command(AudioCommand cmd) {
+  int tail = SDL_AtomicGet(&queue_tail), next = (tail + 1) % AUDIO_QUEUE_SIZE;
+  if (next == SDL_AtomicGet(&queue_head)) {
+    /* queue is full, mixer is stalled -- drain it ourselves */
+    SDL_LockAudioDevice(device);
+    drain_commands();
+    SDL_UnlockAudioDevice(device);
+  }
+  audio_queue[tail] = cmd;
+  SDL_AtomicSet(&queue_tail, next);
+}
 
 static elis_Object *f_play(elis_State *S, elis_Object *args) {
-  Sound *sound = elis_nil(S, args) ? ANY_SOUND
-               : to_userdata(S, elis_next_arg(S, &args), &sound_handlers);
-  /* do some special actions for music source */
-  bool resumed = elis_nil(S, args);
-  if (sound == ANY_SOUND || resumed || !elis_nil(S, elis_next_arg(S, &args))) {
-    /* that music is already playing or paused? */
-    for (int i = 0; i < max_sources; ++i) {
-      if (sources[i].sound && SAME_SOUND(sources[i].sound, sound)) {
-        sources[i].sound = UNTAG(sources[i].sound, PAUSE);
-        resumed = true;
-      }
-    }
-    if (sound == ANY_SOUND || resumed) return elis_bool(S, false);
-    /* mark source as music */
-    sound = SET_TAG(sound, MUSIC);
-  }
-  /* time to strech source buffer? */
-  if (num_sources == max_sources) {
-    int offset = max_sources;
-    next_source = max_sources;
-    max_sources += max_sources >> 2;
-    sources = realloc(sources, max_sources * sizeof(*sources));
-    memset(sources + offset, 0, (max_sources - offset) * sizeof(*sources));
-  }
-  /* find free place for new source */
-  while (sources[next_source].sound) next_source = (next_source + 1) % max_sources;
-  /* add new source to queue */
-  sources[next_source].sound = sound;
-  sources[next_source].position = 0;
-  ++num_sources;
+  if (elis_nil(S, args)) {
+    push_command((AudioCommand) { .op = CMD_RESUME });
+    return elis_bool(S, false);
+  }
+  Sound *sound = to_userdata(S, elis_next_arg(S, &args), &sound_handlers);
+  if (elis_nil(S, args)) {
+    /* resume sound */
+    push_command((AudioCommand) { .op = CMD_RESUME, .sound = sound });
+    return elis_bool(S, false);
+  }
+  bool music = !elis_nil(S, elis_next_arg(S, &args));
+  /* optional parameters of new voice */
+  elis_Number volume = elis_nil(S, args) ? 1 : fmax(elis_to_number(S, elis_next_arg(S, &args)), 0);
+  elis_Number pan    = elis_nil(S, args) ? 0 : fmin(fmax(elis_to_number(S, elis_next_arg(S, &args)), -1), 1);
+  elis_Number rate   = elis_nil(S, args) ? 1 : fmin(fmax(elis_to_number(S, elis_next_arg(S, &args)), 0.01), MAX_RATE);
+  bool timed = !elis_nil(S, args);
+  elis_Number delay  = timed ? elis_to_number(S, elis_next_arg(S, &args)) : 0;
+  elis_Number left = sound->volume * volume * (pan > 0 ? 1 - pan : 1), right = sound->volume * volume * (pan < 0 ? 1 + pan : 1);
+  AudioCommand cmd = {
+    /* resume music or start it, if isn't playing */
+    .op = music ? CMD_RESUME : CMD_PLAY, .sound = sound, .music = music,
+    .gain = { fmin(left, INT16_MAX), fmin(right, INT16_MAX) }, .step = rate * (1 << 16),
+    /* delay is counted from game time of current step */
+    .timed = timed, .now = (double) game_steps * time_step / SDL_GetPerformanceFrequency(), .delay = delay
+  };
+  push_command(cmd);
   return elis_bool(S, false);
 }
 
 static elis_Object *f_stop(elis_State *S, elis_Object *args) {
-  Sound *sound = elis_nil(S, args) ? ANY_SOUND
-               : to_userdata(S, elis_next_arg(S, &args), &sound_handlers);
-  /* find and stop music */
-  for (int i = 0; i < max_sources; ++i) {
-    if (sources[i].sound && SAME_SOUND(sources[i].sound, sound)) {
-      sources[i].sound = NULL;
-    }
-  }
+  Sound *sound = elis_nil(S, args) ? NULL : to_userdata(S, elis_next_arg(S, &args), &sound_handlers);
+  push_command((AudioCommand) { .op = CMD_STOP, .sound = sound });
   return elis_bool(S, false);
 }
 
 static elis_Object *f_pause(elis_State *S, elis_Object *args) {
-  Sound *sound = elis_nil(S, args) ? ANY_SOUND
-               : to_userdata(S, elis_next_arg(S, &args), &sound_handlers);
-  /* find and pause music */
-  for (int i = 0; i < max_sources; ++i) {
-    if (sources[i].sound && SAME_SOUND(sources[i].sound, sound)) {
-      sources[i].sound = SET_TAG(sources[i].sound, PAUSE);
-    }
-  }
+  Sound *sound = elis_nil(S, args) ? NULL : to_userdata(S, elis_next_arg(S, &args), &sound_handlers);
+  push_command((AudioCommand) { .op = CMD_PAUSE, .sound = sound });
+  return elis_bool(S, false);
+}
+
+static elis_Object *f_clock(elis_State *S, elis_Object *args) {
+  uint64_t frames = get_mixer().clock;
+  return elis_number(S, elis_nil(S, args) ? (double) frames / audio.freq : frames);
+}
+
+static elis_Object *f_limit(elis_State *S, elis_Object *args) {
+  Sound *sound = to_userdata(S, elis_next_arg(S, &args), &sound_handlers);
+  int limit = elis_to_number(S, elis_next_arg(S, &args));
+  int priority = elis_nil(S, args) ? 0 : elis_to_number(S, elis_next_arg(S, &args));
+  push_command((AudioCommand) {
+    .op = CMD_LIMIT, .sound = sound,
+    .limit = limit < 0 ? 0 : limit,
+    .priority = priority < 0 ? 0 : priority >= MAX_PRIORITY ? MAX_PRIORITY - 1 : priority
+  });
   return elis_bool(S, false);
 }
 
@@ -466,29 +2815,244 @@ static elis_Object *f_pause(elis_State *S, elis_Object *args) {
  * API: input
  */
 
-static elis_Object *f_key(elis_State *S, elis_Object *args) {
-  SDL_Scancode code = SDL_GetScancodeFromName(elis_to_string(S, elis_next_arg(S, &args)));
-  return elis_bool(S, code == SDL_SCANCODE_UNKNOWN ? false : SDL_GetKeyboardState(NULL)[code]);
+/* names are resolved once and cached, unknown names are mapped to never pressed `SDL_SCANCODE_UNKNOWN` */
+#define KEY_CACHE_SIZE 64
+
+static struct { char name[16]; int button; } key_cache[KEY_CACHE_SIZE];
+static const char *mouse_names[] = { "mouse left", "mouse middle", "mouse right" };
+
+static int to_button(elis_State *S, elis_Object *obj) {
+  const char *name = elis_to_string(S, obj);
+  uint32_t hash = 2166136261u;
+  for (const char *p = name; *p; ++p) hash = (hash ^ (uint8_t) *p) * 16777619u;
+  int idx = hash % KEY_CACHE_SIZE;
+  if (strcmp(key_cache[idx].name, name)) {
+    int button = SDL_GetScancodeFromName(name);
+    for (int i = 0; i < 3; ++i) {
+      if (!strcmp(mouse_names[i], name)) button = SDL_NUM_SCANCODES + i;
+    }
+    /* long names aren't cached */
+    if (strlen(name) >= sizeof(key_cache[idx].name)) return button;
+    strcpy(key_cache[idx].name, name);
+    key_cache[idx].button = button;
+  }
+  return key_cache[idx].button;
 }
 
 static inline int umax(int x, int max) {
   return x < 0 ? 0 : x > max ? max : x;
 }
 
+static void read_input(void) {
+  int n, x, y;
+  const uint8_t *keys = SDL_GetKeyboardState(&n);
+  memcpy(input.buttons, keys, n < SDL_NUM_SCANCODES ? n : SDL_NUM_SCANCODES);
+  /* mouse position is kept in screen coordinates, so it doesn't depend on window size */
+  uint32_t mouse = SDL_GetMouseState(&x, &y);
+  input.x = umax((x - viewport.x) / scale, width);
+  input.y = umax((y - viewport.y) / scale, height);
+  input.buttons[SDL_NUM_SCANCODES + 0] = !!(mouse & SDL_BUTTON(SDL_BUTTON_LEFT));
+  input.buttons[SDL_NUM_SCANCODES + 1] = !!(mouse & SDL_BUTTON(SDL_BUTTON_MIDDLE));
+  input.buttons[SDL_NUM_SCANCODES + 2] = !!(mouse & SDL_BUTTON(SDL_BUTTON_RIGHT));
+}
+
+static elis_Object *f_key(elis_State *S, elis_Object *args) {
+  return elis_bool(S, input.buttons[to_button(S, elis_next_arg(S, &args))]);
+}
+
+static elis_Object *f_pressed(elis_State *S, elis_Object *args) {
+  int button = to_button(S, elis_next_arg(S, &args));
+  return elis_bool(S, input.buttons[button] && !last_input.buttons[button]);
+}
+
+static elis_Object *f_released(elis_State *S, elis_Object *args) {
+  int button = to_button(S, elis_next_arg(S, &args));
+  return elis_bool(S, !input.buttons[button] && last_input.buttons[button]);
+}
+
 static elis_Object *f_mouse(elis_State *S, elis_Object *args) {
-  int x, y;
-  uint8_t keys = SDL_GetMouseState(&x, &y); 
   switch (*elis_to_string(S, elis_next_arg(S, &args))) {
-    case 'L': case 'l': return elis_bool(S, keys & SDL_BUTTON(SDL_BUTTON_LEFT));
-    case 'M': case 'm': return elis_bool(S, keys & SDL_BUTTON(SDL_BUTTON_MIDDLE));
-    case 'R': case 'r': return elis_bool(S, keys & SDL_BUTTON(SDL_BUTTON_RIGHT));
-    case 'W': case 'w': return elis_number(S, wheel);
-    case 'X': case 'x': return elis_number(S, umax((x - viewport.x) / scale, width));
-    case 'Y': case 'y': return elis_number(S, umax((y - viewport.y) / scale, height));
+    case 'L': case 'l': return elis_bool(S, input.buttons[SDL_NUM_SCANCODES + 0]);
+    case 'M': case 'm': return elis_bool(S, input.buttons[SDL_NUM_SCANCODES + 1]);
+    case 'R': case 'r': return elis_bool(S, input.buttons[SDL_NUM_SCANCODES + 2]);
+    case 'W': case 'w': return elis_number(S, input.wheel);
+    case 'X': case 'x': return elis_number(S, input.x);
+    case 'Y': case 'y': return elis_number(S, input.y);
   }
   return elis_bool(S, false);
 }
 
+/*
+ * Record and replay
+ */
+
+/*
+ * file starts with magic, version, random seed and frequency of frame clock, then every frame is
+ * stored as elapsed clock, flags and changed parts of input, numbers are written as varints
+ */
+#define TAPE_MAGIC   "tec"
+#define TAPE_VERSION 1
+
+enum { TAPE_MOUSE = 1, TAPE_WHEEL = 2, TAPE_BUTTONS = 4 };
+
+static FILE *record_file, *replay_file;
+static uint64_t tape_freq;
+static Input tape;
+
+static void put_varint(uint64_t x) {
+  for (; x >= 0x80; x >>= 7) fputc((x & 0x7f) | 0x80, record_file);
+  fputc(x, record_file);
+}
+
+/* returns false at end of file */
+static bool get_varint(uint64_t *x) {
+  *x = 0;
+  for (int shift = 0, c; shift < 64; shift += 7) {
+    if ((c = fgetc(replay_file)) == EOF) return false;
+    *x |= (uint64_t) (c & 0x7f) << shift;
+    if (!(c & 0x80)) return true;
+  }
+  elis_error(S, "replay file is corrupted");
+  return false;
+}
+
+/* signed numbers are zigzag encoded, so small negative numbers stay small */
+static inline uint64_t zigzag(int x) {
+  return x < 0 ? ((uint64_t) -(int64_t) x << 1) - 1 : (uint64_t) x << 1;
+}
+
+static inline int unzigzag(uint64_t x) {
+  return x & 1 ? -(int) (x >> 1) - 1 : (int) (x >> 1);
+}
+
+static void open_record(const char *filename, uint64_t seed) {
+  record_file = fopen(filename, "wb");
+  if (!record_file) elis_error(S, "failed to open record file");
+  fwrite(TAPE_MAGIC, 1, sizeof(TAPE_MAGIC), record_file);
+  put_varint(TAPE_VERSION);
+  put_varint(seed);
+  put_varint(SDL_GetPerformanceFrequency());
+}
+
+static uint64_t open_replay(const char *filename) {
+  char magic[sizeof(TAPE_MAGIC)];
+  uint64_t version = 0, seed = 0;
+  replay_file = fopen(filename, "rb");
+  if (!replay_file) elis_error(S, "failed to open replay file");
+  if (fread(magic, 1, sizeof(magic), replay_file) != sizeof(magic) || memcmp(magic, TAPE_MAGIC, sizeof(magic)) ||
+      !get_varint(&version) || version != TAPE_VERSION || !get_varint(&seed) || !get_varint(&tape_freq) || !tape_freq) {
+    elis_error(S, "incorrect replay file");
+  }
+  return seed;
+}
+
+static void record_frame(uint64_t elapsed) {
+  int flags = 0, changed = 0;
+  if (input.x != tape.x || input.y != tape.y) flags |= TAPE_MOUSE;
+  if (input.wheel) flags |= TAPE_WHEEL;
+  for (int i = 0; i < NUM_BUTTONS; ++i) changed += input.buttons[i] != tape.buttons[i];
+  if (changed) flags |= TAPE_BUTTONS;
+  put_varint(elapsed);
+  put_varint(flags);
+  if (flags & TAPE_MOUSE) {
+    put_varint(input.x);
+    put_varint(input.y);
+  }
+  if (flags & TAPE_WHEEL) put_varint(zigzag(input.wheel));
+  if (flags & TAPE_BUTTONS) {
+    /* store indices of buttons that changed state */
+    put_varint(changed);
+    for (int i = 0; i < NUM_BUTTONS; ++i) {
+      if (input.buttons[i] != tape.buttons[i]) put_varint(i);
+    }
+  }
+  tape = input;
+  /* recording is most needed when game crashes, so every frame is written out at once */
+  fflush(record_file);
+}
+
+/* returns false once all frames are replayed, frame cut off by killed recording ends replay too */
+static bool replay_frame(uint64_t *elapsed) {
+  Input next = tape;
+  uint64_t flags, x, y, wheel = 0, n, i;
+  if (!get_varint(elapsed) || !get_varint(&flags)) return false;
+  if (flags & TAPE_MOUSE) {
+    if (!get_varint(&x) || !get_varint(&y)) return false;
+    next.x = x;
+    next.y = y;
+  }
+  if (flags & TAPE_WHEEL && !get_varint(&wheel)) return false;
+  next.wheel = unzigzag(wheel);
+  if (flags & TAPE_BUTTONS) {
+    if (!get_varint(&n)) return false;
+    for (; n > 0; --n) {
+      if (!get_varint(&i)) return false;
+      if (i >= NUM_BUTTONS) elis_error(S, "replay file is corrupted");
+      next.buttons[i] = !next.buttons[i];
+    }
+  }
+  input = tape = next;
+  /* clock is converted when replay is recorded on machine with other timer frequency */
+  uint64_t freq = SDL_GetPerformanceFrequency();
+  if (freq != tape_freq) *elapsed = (double) *elapsed * freq / tape_freq;
+  return true;
+}
+
+/*
+ * Benchmark
+ */
+
+/* times of every call of each phase are kept to get percentiles at exit */
+enum { BENCH_STEP, BENCH_FRAME, BENCH_RENDER, BENCH_UPLOAD, BENCH_PRESENT, NUM_BENCH };
+
+static struct { const char *name; uint64_t *times; int count, size; } bench[NUM_BENCH] = {
+  [BENCH_STEP]    = { "step"    },
+  [BENCH_FRAME]   = { "frame"   },
+  [BENCH_RENDER]  = { "render"  },
+  [BENCH_UPLOAD]  = { "upload"  },
+  [BENCH_PRESENT] = { "present" }
+};
+
+static int bench_frames;
+static uint64_t bench_start, gc_count, gc_time, gc_start;
+
+static void start_bench(int frames) {
+  bench_frames = frames;
+  for (int i = 0; i < NUM_BENCH; ++i) {
+    /* `step` can be called several times per frame when replaying */
+    bench[i].size = i == BENCH_STEP ? frames * max_steps : frames;
+    bench[i].times = malloc(bench[i].size * sizeof(*bench[i].times));
+  }
+  bench_start = SDL_GetPerformanceCounter();
+}
+
+/* add time since `start` to phase, returns current time to start next phase */
+static inline uint64_t bench_time(int phase, uint64_t start) {
+  uint64_t now = SDL_GetPerformanceCounter();
+  if (bench_frames && bench[phase].count < bench[phase].size) bench[phase].times[bench[phase].count++] = now - start;
+  return now;
+}
+
+static int compare_times(const void *a, const void *b) {
+  uint64_t x = *(const uint64_t *) a, y = *(const uint64_t *) b;
+  return (x > y) - (x < y);
+}
+
+static void print_bench(void) {
+  double ms = 1000.0 / SDL_GetPerformanceFrequency(), total = (SDL_GetPerformanceCounter() - bench_start) * ms;
+  int frames = bench[BENCH_PRESENT].count;
+  printf("%d frames in %.3f ms (%.1f fps)\n", frames, total, frames ? frames * 1000.0 / total : 0);
+  printf("%-8s %10s %10s %10s\n", "ms", "min", "median", "p99");
+  for (int i = 0; i < NUM_BENCH; ++i) {
+    int n = bench[i].count;
+    if (!n) continue;
+    qsort(bench[i].times, n, sizeof(*bench[i].times), compare_times);
+    printf("%-8s %10.3f %10.3f %10.3f\n", bench[i].name,
+           bench[i].times[0] * ms, bench[i].times[n / 2] * ms, bench[i].times[(n * 99 + 99) / 100 - 1] * ms);
+  }
+  printf("gc       %llu collections, %.3f ms\n", (unsigned long long) gc_count, gc_time * ms);
+}
+
 /*
  * API: math
  */
@@ -623,6 +3187,8 @@ static struct { const char *name; elis_CFunction func; } functions[] = {
   /*       utils        */
   { "exit",    f_exit   },
   { "time",    f_time   },
+  { "alpha",   f_alpha  },
+  { "stats",   f_stats  },
   { "load",    f_load   },
   { "type",    f_type   },
   { "sort",    f_sort   },
@@ -631,18 +3197,59 @@ static struct { const char *name; elis_CFunction func; } functions[] = {
   { "clear",   f_clear  },
   { "fill",    f_fill   },
   { "peek",    f_peek   },
+  { "copy",    f_copy   },
   { "draw",    f_draw   },
+  { "blit",    f_blit   },
+  { "text",    f_text   },
+  { "measure", f_measure },
+  { "line",    f_line   },
+  { "circle",  f_circle },
+  { "ellipse", f_ellipse },
+  { "triangle", f_polygon },
+  { "polygon", f_polygon },
   { "clip",    f_clip   },
   { "camera",  f_camera },
   { "width",   f_width  },
   { "height",  f_height },
   { "tilemap", f_tilemap },
+  { "save",    f_save    },
+  { "solid",   f_solid   },
+  { "collide", f_collide },
+  { "sweep",   f_sweep   },
+  { "raycast", f_raycast },
+  { "canvas",  f_canvas  },
+  { "target",  f_target  },
+  { "layer",   f_layer   },
+  { "layers",  f_layers  },
+  /*      palette      */
+  { "palette", f_palette },
+  { "color",   f_color   },
+  { "remap",   f_remap   },
+  { "cycle",   f_cycle   },
+  { "blend",   f_blend   },
+  { "scanlines", f_scanlines },
+  /*    spatial hash    */
+  { "grid",    f_grid    },
+  { "insert",  f_insert  },
+  { "move",    f_move    },
+  { "remove",  f_remove  },
+  { "query",   f_query   },
+  { "pairs",   f_pairs   },
+  /*     particles      */
+  { "emitter", f_emitter },
+  { "emit",    f_emit    },
+  { "simulate", f_simulate },
+  { "plot",    f_plot    },
   /*       audio        */
   { "play",    f_play    },
   { "stop",    f_stop    },
   { "pause",   f_pause   },
+  { "limit",   f_limit   },
+  { "clock",   f_clock   },
   /*       input        */
   { "key",     f_key     },
+  { "pressed", f_pressed },
+  { "released", f_released },
   { "mouse",   f_mouse   },
   /*        math        */
   { "abs",     f_abs     },
@@ -704,48 +3311,103 @@ static const char *get_string(const char *name) {
  * Startup
  */
 
+/* called by elis around every collection, marks objects held only by engine and times collections */
+static void gc_hook(elis_State *S, int done) {
+  (void) S;
+  if (!done) {
+    gc_start = SDL_GetPerformanceCounter();
+    mark_layers();
+  } else if (bench_frames) {
+    gc_count += 1;
+    gc_time += SDL_GetPerformanceCounter() - gc_start;
+  }
+}
+
 static void cleanup(void) {
+  /* print counters */
+  if (dump_stats) {
+    update_stats();
+    for (int i = 0; i < NUM_STATS; ++i) printf("%-16s %g\n", stats[i].name, stats[i].value);
+  }
+  /* print benchmark report */
+  if (bench_frames) print_bench();
+  for (int i = 0; i < NUM_BENCH; ++i) free(bench[i].times);
+  /* stop render threads */
+  stop_threads();
   /* stop audio */
   SDL_CloseAudioDevice(device);
-  free(sources);
+  device = 0;
+  SDL_AtomicSet(&streaming, false);
+  if (streamer) {
+    SDL_SemPost(stream_wake);
+    SDL_WaitThread(streamer, NULL);
+  }
+  free(mix_buffer);
+  free(scratch);
   /* free graphics stuff */
   SDL_DestroyTexture(texture);
   SDL_DestroyRenderer(renderer);
   SDL_DestroyWindow(window);
   free(screen);
   free(pixels);
-  /* free elis state and SDL */
+  free(scanlines);
+  free(cover_cells);
+  free(commands);
+  free(transforms);
+  free(points);
+  SDL_FreeFormat(format);
+  /* finish recording */
+  if (record_file) fclose(record_file);
+  if (replay_file) fclose(replay_file);
+  /* free elis state and SDL, layers don't keep anything alive anymore */
+  if (S) elis_on_gc(S, NULL);
   elis_free(S);
+  SDL_DestroyMutex(stream_lock);
+  SDL_DestroySemaphore(stream_wake);
   SDL_Quit();
 }
 
 static void audio_callback(void *udata, uint8_t *stream, int len) {
   (void) udata;
-  /* make silence */
-  memset(stream, 0, len);
-  /* mix sources */
-  for (int i = 0; i < max_sources; ++i) {
-    if (!sources[i].sound || GET_TAG(sources[i].sound) > MUSIC) continue;
-    Sound *sound = UNTAG(sources[i].sound, ANY);
-    uint32_t remain = sound->length - sources[i].position;
-    if ((uint32_t) len < remain) {
-      /* just mix portion of `len` samples */
-      SDL_MixAudioFormat(stream, sound->buffer + sources[i].position, audio.format, len, sound->volume);
-      sources[i].position += len;
-    } else {
-      /* mix remaining samples */
-      SDL_MixAudioFormat(stream, sound->buffer + sources[i].position, audio.format, remain, sound->volume);
-      /* if source isn't looping -- remove it */
-      if (GET_TAG(sources[i].sound) == SOUND) {
-        sources[i].sound = NULL;
-        --num_sources;
-        continue;
-      }
-      /* reset position and mix more samples to end of stream */
-      sources[i].position = len - remain;
-      SDL_MixAudioFormat(stream, sound->buffer, audio.format, sources[i].position, sound->volume);
+  uint64_t start = SDL_GetPerformanceCounter(), freq = SDL_GetPerformanceFrequency();
+  int frames = len / 4, num_voices = 0;
+  memset(mix_buffer, 0, frames * 2 * sizeof(*mix_buffer));
+  /* apply commands sent since last buffer */
+  drain_commands();
+  /* mix playing voices, free finished ones */
+  for (int p = 0; p <= MAX_PRIORITY; ++p) {
+    for (int i = active[p].first, next; i >= 0; i = next) {
+      Voice *v = &voices[i];
+      next = v->next[BY_PRIORITY];
+      ++num_voices;
+      if (v->paused) continue;
+      /* timed voice starts inside of buffer */
+      int skip = v->delay < (uint32_t) frames ? (int) v->delay : frames;
+      v->delay -= skip;
+      if (skip == frames) continue;
+      int32_t *acc = mix_buffer + skip * 2;
+      if (v->sound->stream ? mix_stream(v, acc, frames - skip) : mix_sound(v, acc, frames - skip)) release_voice(i);
     }
   }
+  write_samples((int16_t *) stream, mix_buffer, frames * 2);
+  /* buffer took longer than its playback, or callback came much later than expected */
+  uint64_t period = frames * freq / audio.freq, end = SDL_GetPerformanceCounter();
+  bool underrun = end - start > period || (last_callback && start - last_callback > 2 * period);
+  last_callback = start;
+  /* advance mixer clock and update counters */
+  double time = (double) (end - start) / freq;
+  SDL_AtomicAdd(&mixer_seq, 1);
+  mixer.clock += frames;
+  mixer.callbacks += 1;
+  mixer.underruns += underrun;
+  mixer.stream_underruns += starved;
+  mixer.time = time;
+  if (time > mixer.max_time) mixer.max_time = time;
+  mixer.mean_time += (time - mixer.mean_time) / mixer.callbacks;
+  mixer.voices = num_voices;
+  if (num_voices > mixer.max_voices) mixer.max_voices = num_voices;
+  SDL_AtomicAdd(&mixer_seq, 1);
+  starved = 0;
 }
 
 static inline void callback(elis_Object *sym) {
@@ -753,23 +3415,77 @@ static inline void callback(elis_Object *sym) {
   elis_restore_gc(S, 0);
 }
 
+static void wait_until(uint64_t time) {
+  uint64_t freq = SDL_GetPerformanceFrequency();
+  /* sleep while it's safe (`SDL_Delay()` isn't precise), then spin */
+  for (uint64_t now; (now = SDL_GetPerformanceCounter()) < time; ) {
+    uint64_t ms = (time - now) * 1000 / freq;
+    if (ms > SPIN_TIME) SDL_Delay(ms - SPIN_TIME);
+  }
+}
+
+static int advance(elis_Object *step, uint64_t elapsed) {
+  double lateness = lag + elapsed > time_step ? (double) (lag + elapsed - time_step) / SDL_GetPerformanceFrequency() : 0;
+  /* call `step` for every elapsed time step, but catch up only limited number of steps */
+  int steps = 0;
+  for (lag += elapsed; lag >= time_step && steps < max_steps; lag -= time_step, ++steps, ++game_steps) {
+    uint64_t start = SDL_GetPerformanceCounter();
+    callback(step);
+    bench_time(BENCH_STEP, start);
+    /* edges of input are seen by one step only */
+    last_input = input;
+  }
+  if (lag >= time_step) {
+    stats[STAT_DROPPED_STEPS].value += lag / time_step;
+    lag %= time_step;
+  }
+  /* update pacing counters */
+  stats[STAT_FRAMES].value += 1;
+  stats[STAT_STEPS].value += steps;
+  stats[STAT_LATE_FRAMES].value += steps > 1;
+  stats[STAT_LATENESS].value = lateness;
+  if (lateness > stats[STAT_MAX_LATENESS].value) stats[STAT_MAX_LATENESS].value = lateness;
+  stats[STAT_MEAN_LATENESS].value += (lateness - stats[STAT_MEAN_LATENESS].value) / stats[STAT_FRAMES].value;
+  return steps;
+}
+
 int main(int argc, char *argv[]) {
   atexit(cleanup);
-  srand(time(NULL));
 
   /*
    * Init Elis, register foreign function and load script
    */
 
   S = elis_init(NULL, NULL);
+  elis_on_gc(S, gc_hook);
   elis_set(S, elis_symbol(S, "PI"), elis_number(S, 3.14159265358979323846));
   elis_set(S, elis_symbol(S, "HUGE"), elis_number(S, HUGE_VAL));
   for (int i = 0; functions[i].name; ++i) {
     elis_set(S, elis_symbol(S, functions[i].name), elis_cfunction(S, functions[i].func));
     elis_restore_gc(S, 0);
   }
-  if (argc < 2) elis_error(S, "script name is missing");
-  load(S, argv[1]);
+  /* parse command line, options may come before or after script name */
+  const char *script = NULL;
+  int frames = 0;
+  random_state = time(NULL);
+  for (int i = 1; i < argc; ++i) {
+    if (!strcmp(argv[i], "--record") && i + 1 < argc) {
+      if (replay_file) elis_error(S, "can't record and replay at same time");
+      open_record(argv[++i], random_state);
+    } else if (!strcmp(argv[i], "--replay") && i + 1 < argc) {
+      if (record_file) elis_error(S, "can't record and replay at same time");
+      random_state = open_replay(argv[++i]);
+    } else if (!strcmp(argv[i], "--bench") && i + 1 < argc) {
+      frames = atoi(argv[++i]);
+      if (frames <= 0) elis_error(S, "number of benchmark frames should be positive");
+    } else if (!strncmp(argv[i], "--", 2)) {
+      elis_error(S, "unknown option");
+    } else {
+      script = argv[i];
+    }
+  }
+  if (!script) elis_error(S, "script name is missing");
+  load(S, script);
   elis_on_error(S, config_error);
   
   /*
@@ -782,11 +3498,20 @@ int main(int argc, char *argv[]) {
   viewport.w = width * scale;
   viewport.h = height * scale;
   time_step = round(SDL_GetPerformanceFrequency() / get_number("FPS", 30));
+  max_steps = get_number("STEPS", 5);
+  vsync = !frames && !elis_nil(S, get_config("VSYNC"));
+  dump_stats = !elis_nil(S, get_config("STATS"));
+  int num = get_number("THREADS", 1);
 
   /*
    * Init SDL and create window
    */
 
+  /* benchmark runs without display and sound card */
+  if (frames) {
+    SDL_setenv("SDL_VIDEODRIVER", "dummy", true);
+    SDL_setenv("SDL_AUDIODRIVER", "dummy", true);
+  }
   if (SDL_Init(SDL_INIT_VIDEO | SDL_INIT_AUDIO)) elis_error(S, SDL_GetError());
   window = SDL_CreateWindow(get_string("TITLE"),
                             SDL_WINDOWPOS_CENTERED, SDL_WINDOWPOS_CENTERED,
@@ -794,21 +3519,26 @@ int main(int argc, char *argv[]) {
                             SDL_WINDOW_SHOWN | SDL_WINDOW_RESIZABLE);
   if (!window) elis_error(S, SDL_GetError());
   SDL_ShowCursor(SDL_DISABLE);
-  renderer = SDL_CreateRenderer(window, -1, 0);
+  renderer = SDL_CreateRenderer(window, -1, vsync ? SDL_RENDERER_PRESENTVSYNC : 0);
   if (!renderer) elis_error(S, SDL_GetError());
+  /* wait by self if vsync isn't available */
+  SDL_RendererInfo info;
+  if (vsync && !SDL_GetRendererInfo(renderer, &info)) vsync = info.flags & SDL_RENDERER_PRESENTVSYNC;
   texture = SDL_CreateTexture(renderer,
                               SDL_GetWindowPixelFormat(window), SDL_TEXTUREACCESS_STREAMING,
                               width, height);
   if (!texture) elis_error(S, SDL_GetError());
   screen = malloc(width * height);
   pixels = malloc(width * height * sizeof(uint32_t));
+  start_threads(num < MAX_THREADS ? num < height ? num : height : MAX_THREADS);
 
   /*
    * Init colors
    */
  
-  SDL_Palette palette = (SDL_Palette) { .colors = (void *) &colors };
+  SDL_Palette palette = (SDL_Palette) { .colors = base_colors };
   for (elis_Object *args = get_config("COLORS"); !elis_nil(S, args); ++num_colors) {
+    if (num_colors == 256) elis_error(S, "too many colors");
     palette.colors[num_colors].r = elis_to_number(S, elis_next_arg(S, &args));
     palette.colors[num_colors].g = elis_to_number(S, elis_next_arg(S, &args));
     palette.colors[num_colors].b = elis_to_number(S, elis_next_arg(S, &args));
@@ -832,35 +3562,46 @@ int main(int argc, char *argv[]) {
       elis_error(S, "incorrect image dimensions, height should be multiple of width");
     }
     /* convert image to palette format and set colorkey */
-    SDL_Surface *surface = SDL_ConvertSurface(bmp, &fmt, 0);
-    if (!surface) elis_error(S, SDL_GetError());
+    Image *image = calloc(1, sizeof(*image));
+    image->surface = SDL_ConvertSurface(bmp, &fmt, 0);
+    if (!image->surface) elis_error(S, SDL_GetError());
     SDL_FreeSurface(bmp);
-    surface->userdata = (void *) (uintptr_t) elis_to_number(S, elis_next_arg(S, &args));
+    image->key = elis_to_number(S, elis_next_arg(S, &args));
+    image->size = image->surface->w;
+    /* precompute opaque spans for fast blitting */
+    encode_spans(image);
     /* create image object */
-    elis_set(S, sym, elis_userdata(S, surface, &image_handlers));
+    elis_set(S, sym, elis_userdata(S, image, &image_handlers));
   }
 
   /*
    * Convert palette colors to window pixel format
    */
 
-  for (int i = 0; i < num_colors; ++i) {
-    SDL_Color col = palette.colors[i];
-    colors[i] = SDL_MapRGB(SDL_GetWindowSurface(window)->format, col.r, col.g, col.b);
+  format = SDL_AllocFormat(SDL_GetWindowPixelFormat(window));
+  if (!format) elis_error(S, SDL_GetError());
+  for (int pal = 0; pal < MAX_PALETTES; ++pal) {
+    for (int i = 0; i < num_colors; ++i) set_color(pal, i, base_colors[i]);
   }
+  scanlines = calloc(height, 1);
 
   /*
    * Init audio
    */
 
-  audio.freq = 44100;
+  audio.freq = get_number("FREQ", 44100);
   audio.format = AUDIO_S16;
   audio.channels = 2;
-  audio.samples = 1024;
+  audio.samples = get_number("SAMPLES", 1024);
   audio.callback = audio_callback;
-  device = SDL_OpenAudioDevice(NULL, 0, &audio, &audio, SDL_AUDIO_ALLOW_ANY_CHANGE);
+  /* mixer works only with signed 16 bit stereo */
+  device = SDL_OpenAudioDevice(NULL, 0, &audio, &audio, SDL_AUDIO_ALLOW_FREQUENCY_CHANGE | SDL_AUDIO_ALLOW_SAMPLES_CHANGE);
   if (!device) elis_error(S, SDL_GetError());
-  sources = calloc(1, max_sources * sizeof(*sources));
+  mix_buffer = malloc(audio.samples * 2 * sizeof(*mix_buffer));
+  scratch = malloc((audio.samples * MAX_RATE + 2) * 2 * sizeof(*scratch));
+  /* all voices are free */
+  for (int i = 0; i < MAX_VOICES; ++i) voices[i].next[BY_PRIORITY] = i + 1 < MAX_VOICES ? i + 1 : -1;
+  for (int p = 0; p <= MAX_PRIORITY; ++p) active[p].first = active[p].last = -1;
   SDL_PauseAudioDevice(device, false);
 
   /*
@@ -869,39 +3610,52 @@ int main(int argc, char *argv[]) {
 
   for (elis_Object *args = get_config("SOUNDS"); !elis_nil(S, args); elis_restore_gc(S, 0)) {
     elis_Object *sym = elis_next_arg(S, &args); 
-    /* load audio */
-    SDL_AudioSpec spec;
-    Sound *sound = malloc(sizeof(*sound));
-    if (!SDL_LoadWAV(elis_to_string(S, elis_next_arg(S, &args)), &spec, &sound->buffer, &sound->length)) {
-      elis_error(S, SDL_GetError());
-    }
-    /* audio format matches to system format? */
-    SDL_AudioCVT cvt;
-    int ret = SDL_BuildAudioCVT(&cvt, spec.format, spec.channels, spec.freq, audio.format, audio.channels, audio.freq); 
-    if (ret == -1) elis_error(S, "can't convert audio");
-    /* convert audio, if needed */
-    if (ret == 1) {
-      /* allocate memory for conversion */
-      cvt.buf = malloc(sound->length * cvt.len_mult);
-      cvt.len = sound->length;
-      memcpy(cvt.buf, sound->buffer, cvt.len);
-      /* convert and replace buffer in `sound` */
-      if (SDL_ConvertAudio(&cvt)) elis_error(S, SDL_GetError());
-      free(sound->buffer);
-      sound->buffer = cvt.buf;
-      sound->length = cvt.len_cvt; 
+    elis_Object *src = elis_next_arg(S, &args);
+    Sound *sound;
+    if (elis_type(S, src) == ELIS_PAIR) {
+      /* synthesize sound from parameters */
+      sound = load_synth(src);
+    } else {
+      /* load audio and convert it to system format */
+      SDL_AudioSpec spec;
+      sound = new_sound();
+      if (!SDL_LoadWAV(elis_to_string(S, src), &spec, &sound->buffer, &sound->length)) elis_error(S, SDL_GetError());
+      convert_sound(sound, &spec);
     }
     /* create sound object */
-    sound->volume = elis_to_number(S, elis_next_arg(S, &args)) * SDL_MIX_MAXVOLUME;
+    sound->volume = elis_to_number(S, elis_next_arg(S, &args)) * UNIT_GAIN;
     elis_set(S, sym, elis_userdata(S, sound, &sound_handlers));
   }
   
+  /*
+   * Open music streams
+   */
+
+  for (elis_Object *args = get_config("MUSIC"); !elis_nil(S, args); elis_restore_gc(S, 0)) {
+    elis_Object *sym = elis_next_arg(S, &args);
+    Sound *sound = new_sound();
+    sound->stream = open_stream(elis_to_string(S, elis_next_arg(S, &args)));
+    sound->limit = 1;
+    sound->volume = elis_to_number(S, elis_next_arg(S, &args)) * UNIT_GAIN;
+    elis_set(S, sym, elis_userdata(S, sound, &sound_handlers));
+  }
+  if (streams) {
+    stream_wake = SDL_CreateSemaphore(0);
+    stream_lock = SDL_CreateMutex();
+    SDL_AtomicSet(&streaming, true);
+    streamer = SDL_CreateThread(stream_thread, "streamer", NULL);
+    if (!streamer) elis_error(S, SDL_GetError());
+  }
+
   /*
    * Erase config variables
    */
 
-  const char *config[] = { "TITLE", "WIDTH", "HEIGHT", "SCALE", "FPS", "COLORS", "IMAGES", "SOUNDS" };
-  for (int i = 0; i < 8; ++i) elis_set(S, elis_symbol(S, config[i]), elis_bool(S, false));
+  const char *config[] = {
+    "TITLE", "WIDTH", "HEIGHT", "SCALE", "FPS", "STEPS", "VSYNC", "THREADS",
+    "COLORS", "IMAGES", "SOUNDS", "MUSIC", "FREQ", "SAMPLES", "STATS"
+  };
+  for (size_t i = 0; i < sizeof(config) / sizeof(*config); ++i) elis_set(S, elis_symbol(S, config[i]), elis_bool(S, false));
 
   /*
    * Game loop
@@ -910,18 +3664,20 @@ int main(int argc, char *argv[]) {
   elis_on_error(S, NULL);
   /* call `init` handler */
   callback(elis_symbol(S, "init"));
-  /* start main loop */
+  /* start main loop, first step is called immediately */
   uint64_t prev_time = SDL_GetPerformanceCounter();
-  elis_Object *step = elis_symbol(S, "step");
+  elis_Object *step = elis_symbol(S, "step"), *frame = elis_symbol(S, "frame");
+  lag = time_step;
+  if (frames) start_bench(frames);
   for (;;) {
     /* process events */
-    wheel = 0;
+    input.wheel = 0;
     for (SDL_Event e; SDL_PollEvent(&e); ) {
       switch (e.type) {
         case SDL_QUIT:
           return EXIT_SUCCESS;
         case SDL_MOUSEWHEEL:
-          wheel = e.wheel.y;
+          input.wheel = e.wheel.y;
           break;
         case SDL_WINDOWEVENT:
           if (e.window.event == SDL_WINDOWEVENT_RESIZED) {
@@ -941,21 +3697,39 @@ int main(int argc, char *argv[]) {
           break;
       }
     }
-    /* call `step` handler */
-    callback(step);
-    /* draw scaled virtual framebuffer on window (how make it faster?) */
-    for (int i = 0; i < width * height; ++i) pixels[i] = colors[screen[i]];
+    /* take input snapshot and clock for this frame, recorded or replayed ones are used as is */
+    uint64_t cur_time = SDL_GetPerformanceCounter(), elapsed = cur_time - prev_time;
+    if (replay_file) {
+      if (!replay_frame(&elapsed)) return EXIT_SUCCESS;
+    } else {
+      read_input();
+      /* benchmark calls `step` once per frame, unless replay says otherwise */
+      if (frames) elapsed = time_step;
+      if (record_file) record_frame(elapsed);
+    }
+    frame_clock += elapsed;
+    /* call `step` handler for elapsed time and `frame` handler once per frame */
+    advance(step, elapsed);
+    prev_time = cur_time;
+    uint64_t start = SDL_GetPerformanceCounter();
+    callback(frame);
+    start = bench_time(BENCH_FRAME, start);
+    /* finish deferred drawing and convert virtual framebuffer to window pixels */
+    render(true);
+    start = bench_time(BENCH_RENDER, start);
+    /* draw scaled virtual framebuffer on window */
     SDL_UpdateTexture(texture, NULL, pixels, width * sizeof(uint32_t));
+    start = bench_time(BENCH_UPLOAD, start);
     SDL_RenderCopy(renderer, texture, NULL, &viewport);
     SDL_RenderPresent(renderer);
-    /* clip framerate */
-    uint64_t cur_time = SDL_GetPerformanceCounter(), end_time = prev_time + time_step;
-    if (end_time > cur_time) {
-      SDL_Delay((end_time - cur_time) * 1000 / SDL_GetPerformanceFrequency());
-      prev_time += time_step;
-    } else {
-      prev_time = cur_time;
+    bench_time(BENCH_PRESENT, start);
+    /* benchmark runs as fast as possible and stops after given number of frames */
+    if (frames) {
+      if (bench[BENCH_PRESENT].count == frames) return EXIT_SUCCESS;
+      continue;
     }
+    /* clip framerate, unless present waits for vertical sync */
+    if (!vsync) wait_until(prev_time + time_step - lag);
   }
 
   return EXIT_SUCCESS;